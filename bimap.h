@@ -1,16 +1,77 @@
 #pragma once
 
 #include "cartesian_tree.h"
+#include "snapshot.h"
+#include <algorithm>
 #include <cstddef>
+#include <cstring>
 #include <functional>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <ostream>
 #include <stdexcept>
+#include <string>
+#include <tuple>
 #include <utility>
+#include <vector>
 
 struct left_tag {};
 struct right_tag {};
 
+struct default_bimap_policy {
+    using priority = details::stored_priority;
+    using layout = details::parent_layout;
+    using augmentation = details::no_subtree_size;
+    using statistics = details::no_statistics;
+};
+
+struct address_hashed_bimap_policy : default_bimap_policy {
+    using priority = details::address_hashed_priority;
+};
+
+struct key_hashed_bimap_policy : default_bimap_policy {
+    using priority = details::key_hashed_priority;
+};
+
+// iterators reach the map through a cell allocated with the first node, so
+// an end iterator taken while the map was empty cannot be decremented later
+struct compact_bimap_policy : default_bimap_policy {
+    using layout = details::compact_layout;
+};
+
+struct order_statistics_bimap_policy : default_bimap_policy {
+    using augmentation = details::subtree_size;
+};
+
+struct instrumented_bimap_policy : default_bimap_policy {
+    using statistics = details::tree_statistics;
+};
+
+struct bimap_shape {
+    details::tree_shape left;
+    details::tree_shape right;
+    bool sizes_match;
+
+    bool valid() const noexcept {
+        return left.valid() && right.valid() && sizes_match;
+    }
+};
+
+struct bimap_stats {
+    details::tree_stats left;
+    details::tree_stats right;
+    uint64_t allocations;
+    uint64_t frees;
+};
+
 template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
-          typename CompareRight = std::less<Right>>
+          typename CompareRight = std::less<Right>,
+          typename Allocator = std::allocator<std::pair<Left, Right>>,
+          typename Policy = default_bimap_policy>
 struct bimap {
 
     template <typename left_it, typename right_it, typename left_it_tag,
@@ -21,31 +82,57 @@ struct bimap {
     using right_t = Right;
     using cmp_left_t = CompareLeft;
     using cmp_right_t = CompareRight;
+    using allocator_type = Allocator;
+    using policy_t = Policy;
+    using node_base_t = details::node_base_t<Policy>;
+    using left_tree_t = details::tree<left_t, cmp_left_t, left_tag, Policy>;
+    using right_tree_t =
+        details::tree<right_t, cmp_right_t, right_tag, Policy>;
     using left_iterator = base_iterator<left_t, right_t, left_tag, right_tag>;
     using right_iterator = base_iterator<right_t, left_t, right_tag, left_tag>;
 
-    struct node : details::tree_node<Left, left_tag>, details::tree_node<Right, right_tag> {
+    struct node : details::tree_node<Left, left_tag, Policy>,
+                  details::tree_node<Right, right_tag, Policy> {
         template <typename LeftT, typename RightT>
         node(LeftT&& left, RightT&& right)
-            : details::tree_node<Left, left_tag>(std::forward<LeftT>(left)),
-              details::tree_node<Right, right_tag>(std::forward<RightT>(right)) {}
+            : details::tree_node<Left, left_tag, Policy>(
+                  std::forward<LeftT>(left)),
+              details::tree_node<Right, right_tag, Policy>(
+                  std::forward<RightT>(right)) {}
+
+        template <typename... LeftArgs, typename... RightArgs>
+        node(std::piecewise_construct_t, std::tuple<LeftArgs...> left,
+             std::tuple<RightArgs...> right)
+            : details::tree_node<Left, left_tag, Policy>(
+                  std::piecewise_construct, std::move(left)),
+              details::tree_node<Right, right_tag, Policy>(
+                  std::piecewise_construct, std::move(right)) {}
 
         template <typename X, typename Tag>
-        details::tree_node<X, Tag>& to_tree_node() {
-            return static_cast<details::tree_node<X, Tag>&>(*this);
+        details::tree_node<X, Tag, Policy>& to_tree_node() {
+            return static_cast<details::tree_node<X, Tag, Policy>&>(*this);
         }
     };
 
     using node_t = node;
+    using node_allocator_t = typename std::allocator_traits<
+        allocator_type>::template rebind_alloc<node_t>;
+    using node_allocator_traits = std::allocator_traits<node_allocator_t>;
 
     template <typename X, typename Tag>
-    static node_t& to_bimap_node(details::tree_node<X, Tag>& v) {
+    static node_t& to_bimap_node(details::tree_node<X, Tag, Policy>& v) {
         return static_cast<node_t&>(v);
     }
 
+    static constexpr bool has_parent = Policy::layout::has_parent;
+    static constexpr bool order_statistics = Policy::augmentation::enabled;
+    static constexpr bool instrumented = Policy::statistics::enabled;
+    static constexpr bool flat_keys = std::is_trivially_copyable_v<left_t> &&
+                                      std::is_trivially_copyable_v<right_t>;
+
     template <typename LeftT, typename RightT, typename LeftTag,
               typename RightTag>
-    struct base_iterator {
+    struct base_iterator : details::owner_ref<bimap, !has_parent> {
 
         using iterator_category = std::bidirectional_iterator_tag;
         using value_type = LeftT;
@@ -53,14 +140,22 @@ struct bimap {
         using pointer = LeftT*;
         using difference_type = std::ptrdiff_t;
 
-        base_iterator(details::node_base* ptr_) : ptr(ptr_){};
+        base_iterator(node_base_t* ptr_, bimap const* owner)
+            : details::owner_ref<bimap, !has_parent>(owner->get_home()),
+              ptr(ptr_) {
+            if constexpr (!has_parent) {
+                ptr = (ptr == owner->template tree_of<LeftTag>().end()
+                           ? nullptr
+                           : ptr);
+            }
+        }
 
         base_iterator() = default;
 
         base_iterator(const base_iterator& other) = default;
 
         LeftT const& operator*() const {
-            return details::get_value<LeftT, LeftTag>(ptr);
+            return details::get_value<LeftT, LeftTag, Policy>(ptr);
         }
 
         LeftT const* operator->() const {
@@ -68,7 +163,11 @@ struct bimap {
         }
 
         base_iterator& operator++() {
-            ptr = get_next(ptr);
+            if constexpr (has_parent) {
+                ptr = get_next(ptr);
+            } else {
+                ptr = from_tree(tree().next(ptr));
+            }
             return *this;
         }
 
@@ -79,7 +178,11 @@ struct bimap {
         }
 
         base_iterator& operator--() {
-            ptr = get_prev(ptr);
+            if constexpr (has_parent) {
+                ptr = get_prev(ptr);
+            } else {
+                ptr = from_tree(tree().prev(to_tree(ptr)));
+            }
             return *this;
         }
         base_iterator operator--(int) {
@@ -88,6 +191,39 @@ struct bimap {
             return copy;
         }
 
+        base_iterator& operator+=(difference_type n) noexcept {
+            static_assert(order_statistics,
+                          "random advance needs subtree sizes in the policy");
+            if constexpr (has_parent) {
+                auto [index, sentinel] = tree_t::climb(ptr);
+                ptr = tree_t::select(sentinel, index + n);
+            } else {
+                ptr = from_tree(
+                    tree().nth(tree().index_of(to_tree(ptr)) + n));
+            }
+            return *this;
+        }
+
+        base_iterator& operator-=(difference_type n) noexcept {
+            return *this += -n;
+        }
+
+        friend base_iterator operator+(base_iterator it,
+                                       difference_type n) noexcept {
+            return it += n;
+        }
+
+        friend base_iterator operator-(base_iterator it,
+                                       difference_type n) noexcept {
+            return it -= n;
+        }
+
+        friend difference_type operator-(base_iterator const& a,
+                                         base_iterator const& b) noexcept {
+            return static_cast<difference_type>(a.index()) -
+                   static_cast<difference_type>(b.index());
+        }
+
         bool operator==(const base_iterator& other) const noexcept {
             return (ptr == other.ptr);
         }
@@ -100,58 +236,209 @@ struct bimap {
             base_iterator<RightT, LeftT, RightTag, LeftTag>;
 
         another_iterator flip() const {
-            if (ptr->parent == nullptr) {
-                return another_iterator(ptr->right);
+            if (is_end()) {
+                if constexpr (has_parent) {
+                    return another_iterator(ptr->right, this->get_home());
+                } else {
+                    return another_iterator(nullptr, this->get_home());
+                }
             } else {
-                details::tree_node<LeftT, LeftTag>* cartesian_node =
-                    &details::base_to_tree_node<LeftT, LeftTag>(*ptr);
+                details::tree_node<LeftT, LeftTag, Policy>* cartesian_node =
+                    &details::base_to_tree_node<LeftT, LeftTag, Policy>(*ptr);
 
                 node_t* bimap_node =
                     &to_bimap_node<LeftT, LeftTag>(*cartesian_node);
 
-                details::tree_node<RightT, RightTag>* casted_cartesian_node =
-                    &bimap_node->template to_tree_node<RightT, RightTag>();
+                details::tree_node<RightT, RightTag, Policy>*
+                    casted_cartesian_node =
+                        &bimap_node->template to_tree_node<RightT, RightTag>();
 
-                details::node_base* right_ptr =
-                    &details::to_base<RightT, RightTag>(*casted_cartesian_node);
+                node_base_t* right_ptr =
+                    &details::to_base<RightT, RightTag, Policy>(
+                        *casted_cartesian_node);
 
-                return another_iterator(right_ptr);
+                return another_iterator(right_ptr, this->get_home());
             }
         }
 
         friend struct bimap;
 
+        template <typename, typename, typename, typename>
+        friend struct base_iterator;
+
       private:
-        details::node_base* ptr{nullptr};
+        base_iterator(node_base_t* ptr_,
+                      details::owner_home<bimap> const* home) noexcept
+            : details::owner_ref<bimap, !has_parent>(home), ptr(ptr_) {}
+
+        // compact iterators hold nullptr at the end, as the sentinel is
+        // part of the map and moves with it
+        node_base_t* to_tree(node_base_t* v) const noexcept {
+            return (v == nullptr ? tree().end() : v);
+        }
+
+        node_base_t* from_tree(node_base_t* v) const noexcept {
+            return (v == tree().end() ? nullptr : v);
+        }
+
+        using tree_t = std::conditional_t<std::is_same_v<LeftTag, left_tag>,
+                                          left_tree_t, right_tree_t>;
+
+        auto const& tree() const noexcept {
+            return this->get_owner()->template tree_of<LeftTag>();
+        }
+
+        std::size_t index() const noexcept {
+            static_assert(order_statistics,
+                          "distance needs subtree sizes in the policy");
+            if constexpr (has_parent) {
+                return tree_t::climb(ptr).first;
+            } else {
+                return tree().index_of(to_tree(ptr));
+            }
+        }
+
+        bool is_end() const noexcept {
+            if constexpr (has_parent) {
+                return ptr->parent == nullptr;
+            } else {
+                return ptr == nullptr;
+            }
+        }
+
+        node_base_t* ptr{nullptr};
     };
 
+    static void seed_priorities(uint64_t seed) noexcept {
+        details::seed_priorities(seed);
+    }
+
     void share_pointers() noexcept {
         left_tree.set_another_tree_pointer(&right_tree.sentinel);
         right_tree.set_another_tree_pointer(&left_tree.sentinel);
     }
 
     bimap(cmp_left_t compare_left = CompareLeft(),
-          cmp_right_t compare_right = CompareRight())
+          cmp_right_t compare_right = CompareRight(),
+          allocator_type const& alloc = allocator_type())
         : left_tree(std::move(compare_left)),
-          right_tree(std::move(compare_right)) {
+          right_tree(std::move(compare_right)), data(node_allocator_t(alloc)) {
         share_pointers();
     }
 
+    explicit bimap(allocator_type const& alloc)
+        : bimap(CompareLeft(), CompareRight(), alloc) {}
+
     bimap(bimap const& other)
         : left_tree(other.left_tree.cmp()),
-          right_tree(other.right_tree.cmp()) {
+          right_tree(other.right_tree.cmp()),
+          data(node_allocator_traits::select_on_container_copy_construction(
+              other.node_allocator())) {
         share_pointers();
-        auto left_it = other.begin_left();
-        while (left_it != other.end_left()) {
-            insert(*left_it, *left_it.flip());
-            left_it++;
+        std::vector<node_t*> nodes;
+        nodes.reserve(other.size());
+        try {
+            for (auto it = other.begin_left(); it != other.end_left(); it++) {
+                nodes.push_back(create_node(*it, *it.flip()));
+            }
+        } catch (...) {
+            destroy_nodes(nodes);
+            throw;
         }
+        link_sorted(nodes, true);
     }
 
     bimap(bimap&& other) noexcept :
           left_tree(std::move(other.left_tree)),
-          right_tree(std::move(other.right_tree)) {
+          right_tree(std::move(other.right_tree)),
+          data(std::move(other.node_allocator())) {
+        std::swap(data.sz, other.data.sz);
         share_pointers();
+        if constexpr (!has_parent) {
+            std::swap(data.home, other.data.home);
+            adopt_home();
+        }
+    }
+
+    template <typename InputIt>
+    static bimap from_sorted(InputIt first, InputIt last,
+                             cmp_left_t compare_left = CompareLeft(),
+                             cmp_right_t compare_right = CompareRight(),
+                             allocator_type const& alloc = allocator_type()) {
+        bimap result(std::move(compare_left), std::move(compare_right), alloc);
+        result.fill_sorted(first, last);
+        return result;
+    }
+
+    template <typename Range>
+    static bimap from_sorted(Range const& range) {
+        return from_sorted(std::begin(range), std::end(range));
+    }
+
+    // loads unsorted pairs on up to threads threads, dropping the same
+    // pairs from_sorted would; comparators are called concurrently
+    template <typename Range>
+    static bimap build_parallel(Range const& range,
+                                unsigned threads = details::default_threads()) {
+        bimap result;
+        result.fill_parallel(std::begin(range), std::end(range), threads);
+        return result;
+    }
+
+    // a binary snapshot, see details::snapshot_header for the layout; the
+    // comparators are not saved, so load with the same ones
+    template <bool Flat = flat_keys, typename = std::enable_if_t<Flat>>
+    void save(std::ostream& out) const {
+        write_snapshot([&out](char const* bytes, std::size_t size) {
+            if (!out.write(bytes, static_cast<std::streamsize>(size))) {
+                throw snapshot_error("cannot write bimap snapshot");
+            }
+        });
+    }
+
+    template <bool Flat = flat_keys, typename = std::enable_if_t<Flat>>
+    void save(int fd) const {
+        write_snapshot([fd](char const* bytes, std::size_t size) {
+            details::write_all(fd, bytes, size);
+        });
+    }
+
+    // maps the file and links both trees in linear time; throws
+    // snapshot_error if the file is damaged or was saved with other types
+    // or comparators
+    template <bool Flat = flat_keys, typename = std::enable_if_t<Flat>>
+    static bimap load(std::string const& path,
+                      cmp_left_t compare_left = CompareLeft(),
+                      cmp_right_t compare_right = CompareRight(),
+                      allocator_type const& alloc = allocator_type()) {
+        details::mapped_file file(path);
+        bimap result(std::move(compare_left), std::move(compare_right), alloc);
+        result.fill_snapshot(file.data(), file.size());
+        return result;
+    }
+
+    template <bool Flat = flat_keys, typename = std::enable_if_t<Flat>>
+    static bimap load(std::istream& in,
+                      cmp_left_t compare_left = CompareLeft(),
+                      cmp_right_t compare_right = CompareRight(),
+                      allocator_type const& alloc = allocator_type()) {
+        std::vector<char> bytes((std::istreambuf_iterator<char>(in)),
+                                std::istreambuf_iterator<char>());
+        bimap result(std::move(compare_left), std::move(compare_right), alloc);
+        result.fill_snapshot(bytes.data(), bytes.size());
+        return result;
+    }
+
+    template <typename InputIt>
+    void assign_sorted(InputIt first, InputIt last) {
+        bimap result(left_tree.cmp(), right_tree.cmp(), get_allocator());
+        result.fill_sorted(first, last);
+        swap(result);
+    }
+
+    template <typename Range>
+    void assign_sorted(Range const& range) {
+        assign_sorted(std::begin(range), std::end(range));
     }
 
     bimap& operator=(bimap const& other) {
@@ -173,39 +460,361 @@ struct bimap {
     void swap(bimap& other) noexcept {
         left_tree.swap(other.left_tree);
         right_tree.swap(other.right_tree);
-        std::swap(sz, other.sz);
+        if constexpr (node_allocator_traits::propagate_on_container_swap::
+                          value) {
+            std::swap(node_allocator(), other.node_allocator());
+        }
+        std::swap(data.sz, other.data.sz);
         share_pointers();
         other.share_pointers();
+        if constexpr (!has_parent) {
+            std::swap(data.home, other.data.home);
+            adopt_home();
+            other.adopt_home();
+        }
     }
 
     ~bimap() {
-        left_iterator it = begin_left();
-        while (it != end_left()) {
-            erase_left(it++);
-        }
+        clear();
+        free_home();
     }
 
+    void clear() noexcept {
+        left_tree.clear([this](node_base_t* v) {
+            destroy_node(&to_bimap_node<left_t, left_tag>(
+                details::base_to_tree_node<left_t, left_tag, Policy>(*v)));
+        });
+        right_tree.set_root(nullptr);
+        data.sz = 0;
+    }
+
+    // both keys are looked up before the node is made, so a rejected pair
+    // is neither allocated nor moved from
     template <typename X = left_t, typename Y = right_t>
     left_iterator insert(X&& left, Y&& right) noexcept {
-        if (left_tree.find(left) != left_tree.end()) {
+        auto left_path = left_tree.locate(left);
+        if (left_path.found != nullptr) {
             return end_left();
         }
-        if (right_tree.find(right) != right_tree.end()) {
+        auto right_path = right_tree.locate(right);
+        if (right_path.found != nullptr) {
             return end_left();
         }
         node_t* new_node =
-            new node_t(std::forward<X>(left), std::forward<Y>(right));
-        details::node_base* result = left_tree.insert(
-            &new_node->template to_tree_node<left_t, left_tag>());
+            create_node(std::forward<X>(left), std::forward<Y>(right));
+        node_base_t* result = left_tree.insert(
+            &new_node->template to_tree_node<left_t, left_tag>(), left_path);
         right_tree.insert(
-            &new_node->template to_tree_node<right_t, right_tag>());
-        sz++;
-        return left_iterator(result);
+            &new_node->template to_tree_node<right_t, right_tag>(),
+            right_path);
+        data.sz++;
+        return left_iterator(result, this);
+    }
+
+    // hint is the element right after or right before the new one; a hint
+    // that does not fit, or the compact layout, falls back to plain insert
+    template <typename X = left_t, typename Y = right_t>
+    left_iterator insert(left_iterator hint, X&& left, Y&& right) {
+        if constexpr (has_parent) {
+            auto [prev, next] = left_tree.neighbours(hint.ptr, left);
+            if (next != nullptr) {
+                auto right_path = right_tree.locate(right);
+                if (right_path.found != nullptr) {
+                    return end_left();
+                }
+                node_t* new_node =
+                    create_node(std::forward<X>(left), std::forward<Y>(right));
+                right_tree.insert(
+                    &new_node->template to_tree_node<right_t, right_tag>(),
+                    right_path);
+                node_base_t* result = left_tree.insert_before(
+                    next, prev,
+                    &new_node->template to_tree_node<left_t, left_tag>());
+                data.sz++;
+                return left_iterator(result, this);
+            }
+        }
+        return insert(std::forward<X>(left), std::forward<Y>(right));
+    }
+
+    template <typename... Args>
+    left_iterator emplace_left(Args&&... args) {
+        return link_node(create_node(std::forward<Args>(args)...));
+    }
+
+    template <typename... Args>
+    right_iterator emplace_right(Args&&... args) {
+        return emplace_left(std::forward<Args>(args)...).flip();
+    }
+
+    template <typename... Args>
+    left_iterator emplace(Args&&... args) {
+        return emplace_left(std::forward<Args>(args)...);
+    }
+
+    // the batch is sorted and united with each tree in one pass; a pair is
+    // skipped if either key is present or used by an earlier pair of the
+    // batch. Returns the number of inserted pairs
+    template <typename Range>
+    std::size_t insert_batch(Range const& range) {
+        std::vector<node_t*> nodes =
+            create_nodes(std::begin(range), std::end(range));
+        std::vector<std::size_t> order;
+        std::vector<node_base_t*> bases;
+        std::vector<node_t*> dropped;
+        std::vector<std::reference_wrapper<left_t const>> dropped_keys;
+        try {
+            order.resize(nodes.size());
+            bases.reserve(nodes.size());
+            dropped.reserve(nodes.size());
+            dropped_keys.reserve(nodes.size());
+        } catch (...) {
+            destroy_nodes(nodes);
+            throw;
+        }
+
+        // nodes stay in batch order and are sorted by index, so a key shared
+        // by several pairs goes to the earliest one on either side
+        std::iota(order.begin(), order.end(), 0);
+        auto left_less = [this, &nodes](std::size_t a, std::size_t b) {
+            return left_tree.less(left_value(nodes[a]), left_value(nodes[b]));
+        };
+        if (!std::is_sorted(order.begin(), order.end(), left_less)) {
+            std::stable_sort(order.begin(), order.end(), left_less);
+        }
+        for (std::size_t i : order) {
+            if (!bases.empty() &&
+                !left_tree.less(left_tree.value_of(bases.back()),
+                                left_value(nodes[i]))) {
+                destroy_node(nodes[i]);
+                nodes[i] = nullptr;
+            } else {
+                bases.push_back(left_base(nodes[i]));
+            }
+        }
+        left_tree.unite(
+            left_tree.make_treap(bases.begin(), bases.end()),
+            [&](node_base_t* v) { dropped.push_back(from_left_base(v)); });
+        std::sort(dropped.begin(), dropped.end());
+        order.clear();
+        for (std::size_t i = 0; i < nodes.size(); i++) {
+            if (nodes[i] == nullptr) {
+                continue;
+            }
+            if (std::binary_search(dropped.begin(), dropped.end(), nodes[i])) {
+                destroy_node(nodes[i]);
+            } else {
+                order.push_back(i);
+            }
+        }
+        dropped.clear();
+
+        // from here on a dropped pair is already linked into the left tree
+        std::stable_sort(order.begin(), order.end(),
+                         [this, &nodes](std::size_t a, std::size_t b) {
+                             return right_tree.less(right_value(nodes[a]),
+                                                    right_value(nodes[b]));
+                         });
+        bases.clear();
+        for (std::size_t i : order) {
+            if (!bases.empty() &&
+                !right_tree.less(right_tree.value_of(bases.back()),
+                                 right_value(nodes[i]))) {
+                dropped.push_back(nodes[i]);
+            } else {
+                bases.push_back(right_base(nodes[i]));
+            }
+        }
+        right_tree.unite(
+            right_tree.make_treap(bases.begin(), bases.end()),
+            [&](node_base_t* v) { dropped.push_back(from_right_base(v)); });
+        for (node_t* v : dropped) {
+            dropped_keys.push_back(std::cref(left_value(v)));
+        }
+        std::sort(dropped_keys.begin(), dropped_keys.end(),
+                  [this](left_t const& a, left_t const& b) {
+                      return left_tree.less(a, b);
+                  });
+        left_tree.subtract(dropped_keys.begin(), dropped_keys.end(),
+                           [](node_base_t*) {});
+        destroy_nodes(dropped);
+        data.sz += order.size() - dropped.size();
+        return order.size() - dropped.size();
+    }
+
+    // steals every pair of other whose keys are both absent here; the rest
+    // stays in other, as with std::map::merge. Both trees are united with
+    // other's on up to threads threads, which then call the comparators
+    // concurrently. Nodes are only copied when the allocators differ
+    void merge(bimap&& other, unsigned threads = 1) {
+        if (&other == this || other.empty()) {
+            return;
+        }
+        if (node_allocator() != other.node_allocator()) {
+            for (auto it = other.begin_left(); it != other.end_left();) {
+                if (insert(*it, *it.flip()) != end_left()) {
+                    it = other.erase_left(it);
+                } else {
+                    ++it;
+                }
+            }
+            return;
+        }
+        make_home();
+        std::size_t incoming = other.size();
+        std::vector<node_t*> rejected;
+        std::vector<std::reference_wrapper<left_t const>> left_keys;
+        std::vector<std::reference_wrapper<right_t const>> right_keys;
+        std::vector<node_base_t*> bases;
+        rejected.reserve(incoming);
+        left_keys.reserve(incoming);
+        right_keys.reserve(incoming);
+        bases.reserve(incoming);
+        std::mutex guard;
+
+        node_base_t* incoming_left = other.left_tree.root();
+        other.left_tree.set_root(nullptr);
+        left_tree.unite_parallel(
+            incoming_left, size() + incoming,
+            [&](node_base_t* v) {
+                std::lock_guard<std::mutex> lock(guard);
+                rejected.push_back(from_left_base(v));
+            },
+            threads);
+        for (node_t* v : rejected) {
+            right_keys.push_back(std::cref(right_value(v)));
+        }
+        std::sort(right_keys.begin(), right_keys.end(),
+                  [this](right_t const& a, right_t const& b) {
+                      return right_tree.less(a, b);
+                  });
+        other.right_tree.subtract(right_keys.begin(), right_keys.end(),
+                                  [](node_base_t*) {});
+
+        std::size_t left_rejected = rejected.size();
+        node_base_t* incoming_right = other.right_tree.root();
+        other.right_tree.set_root(nullptr);
+        right_tree.unite_parallel(
+            incoming_right, size() + incoming - left_rejected,
+            [&](node_base_t* v) {
+                std::lock_guard<std::mutex> lock(guard);
+                rejected.push_back(from_right_base(v));
+            },
+            threads);
+        // these are linked into the left tree already
+        for (std::size_t i = left_rejected; i < rejected.size(); i++) {
+            left_keys.push_back(std::cref(left_value(rejected[i])));
+        }
+        std::sort(left_keys.begin(), left_keys.end(),
+                  [this](left_t const& a, left_t const& b) {
+                      return left_tree.less(a, b);
+                  });
+        left_tree.subtract(left_keys.begin(), left_keys.end(),
+                           [](node_base_t*) {});
+        data.sz += incoming - rejected.size();
+
+        std::sort(rejected.begin(), rejected.end(),
+                  [this](node_t* a, node_t* b) {
+                      return left_tree.less(left_value(a), left_value(b));
+                  });
+        for (node_t* v : rejected) {
+            bases.push_back(left_base(v));
+        }
+        other.left_tree.build(bases.begin(), bases.end());
+        std::sort(rejected.begin(), rejected.end(),
+                  [this](node_t* a, node_t* b) {
+                      return right_tree.less(right_value(a), right_value(b));
+                  });
+        bases.clear();
+        for (node_t* v : rejected) {
+            bases.push_back(right_base(v));
+        }
+        other.right_tree.build(bases.begin(), bases.end());
+        other.data.sz = rejected.size();
+    }
+
+    // moves the pairs with left keys not less than key into the returned
+    // bimap. The left tree is split in O(log n); on the right side only the
+    // moved pairs are cut out and relinked, no node is reallocated
+    bimap split_left(left_t const& key) {
+        bimap result(left_tree.cmp(), right_tree.cmp(), get_allocator());
+        std::vector<node_base_t*> moved;
+        std::vector<std::reference_wrapper<right_t const>> right_keys;
+        node_base_t* moved_root = left_tree.split_off(key);
+        try {
+            if (moved_root != nullptr) {
+                result.make_home();
+                moved.push_back(moved_root);
+            }
+            for (std::size_t i = 0; i < moved.size(); i++) {
+                if (moved[i]->left != nullptr) {
+                    moved.push_back(moved[i]->left);
+                }
+                if (moved[i]->right != nullptr) {
+                    moved.push_back(moved[i]->right);
+                }
+            }
+            right_keys.reserve(moved.size());
+        } catch (...) {
+            left_tree.rejoin(moved_root);
+            throw;
+        }
+        result.left_tree.set_root(moved_root);
+
+        for (node_base_t*& v : moved) {
+            v = right_base(from_left_base(v));
+        }
+        std::sort(moved.begin(), moved.end(),
+                  [this](node_base_t* a, node_base_t* b) {
+                      return right_tree.less(right_tree.value_of(a),
+                                             right_tree.value_of(b));
+                  });
+        for (node_base_t* v : moved) {
+            right_keys.push_back(std::cref(right_tree.value_of(v)));
+        }
+        right_tree.subtract(right_keys.begin(), right_keys.end(),
+                            [](node_base_t*) {});
+        result.right_tree.build(moved.begin(), moved.end());
+        result.data.sz = right_keys.size();
+        data.sz -= right_keys.size();
+        return result;
+    }
+
+    // erases the pairs with the given left keys by cutting them out of each
+    // tree in one pass; returns the number of erased pairs
+    template <typename Range>
+    std::size_t erase_batch(Range const& keys) {
+        std::vector<std::reference_wrapper<left_t const>> sorted(
+            std::begin(keys), std::end(keys));
+        std::vector<node_t*> erased;
+        std::vector<std::reference_wrapper<right_t const>> right_keys;
+        erased.reserve(sorted.size());
+        right_keys.reserve(sorted.size());
+        std::sort(sorted.begin(), sorted.end(),
+                  [this](left_t const& a, left_t const& b) {
+                      return left_tree.less(a, b);
+                  });
+        left_tree.subtract(
+            sorted.begin(), sorted.end(),
+            [&](node_base_t* v) { erased.push_back(from_left_base(v)); });
+
+        for (node_t* v : erased) {
+            right_keys.push_back(std::cref(right_value(v)));
+        }
+        std::sort(right_keys.begin(), right_keys.end(),
+                  [this](right_t const& a, right_t const& b) {
+                      return right_tree.less(a, b);
+                  });
+        right_tree.subtract(right_keys.begin(), right_keys.end(),
+                            [](node_base_t*) {});
+        destroy_nodes(erased);
+        data.sz -= erased.size();
+        return erased.size();
     }
 
     left_iterator erase_left(left_iterator it) noexcept {
         if (it == end_left()) {
-            return left_iterator(nullptr);
+            return left_iterator(nullptr, this);
         }
         right_iterator right_it = it.flip();
         left_iterator res = it;
@@ -213,69 +822,108 @@ struct bimap {
         left_tree.erase_helper(it.ptr);
         right_tree.erase_helper(right_it.ptr);
         node_t* casted_e = &to_bimap_node<left_t, left_tag>(
-            details::base_to_tree_node<left_t, left_tag>(*it.ptr));
-        delete casted_e;
-        sz--;
+            details::base_to_tree_node<left_t, left_tag, Policy>(*it.ptr));
+        destroy_node(casted_e);
+        data.sz--;
         return res;
     }
 
     bool erase_left(left_t const& left) noexcept {
-        details::node_base* found = left_tree.find(left);
-        return erase_left(left_iterator(found)) != left_iterator(nullptr);
+        return erase_found(find_left(left));
+    }
+
+    template <typename K, typename C = cmp_left_t,
+              typename = typename C::is_transparent>
+    bool erase_left(K const& left) noexcept {
+        return erase_found(find_left(left));
     }
 
     right_iterator erase_right(right_iterator it) noexcept {
         if (it == end_right()) {
-            return right_iterator(nullptr);
+            return right_iterator(nullptr, this);
         }
         return erase_left(it.flip()).flip();
     }
 
     bool erase_right(right_t const& right) noexcept {
-        details::node_base* found = right_tree.find(right);
-        return erase_right(right_iterator(found)) != right_iterator(nullptr);
+        return erase_found(find_right(right).flip());
     }
 
+    template <typename K, typename C = cmp_right_t,
+              typename = typename C::is_transparent>
+    bool erase_right(K const& right) noexcept {
+        return erase_found(find_right(right).flip());
+    }
+
+    // the range is cut out of the driving tree with two splits; only the
+    // other tree is updated node by node
     left_iterator erase_left(left_iterator first, left_iterator last) noexcept {
-        while (first != last) {
-            erase_left(first++);
+        if (first == last) {
+            return last;
         }
+        left_tree.dispose(left_tree.cut(first.ptr, tree_node_of(last)),
+                          [this](node_base_t* v) {
+                              node_t* node = from_left_base(v);
+                              right_tree.erase_helper(right_base(node));
+                              destroy_node(node);
+                              data.sz--;
+                          });
         return last;
     }
 
     right_iterator erase_right(right_iterator first,
                                right_iterator last) noexcept {
-        while (first != last) {
-            erase_right(first++);
+        if (first == last) {
+            return last;
         }
+        right_tree.dispose(right_tree.cut(first.ptr, tree_node_of(last)),
+                           [this](node_base_t* v) {
+                               node_t* node = from_right_base(v);
+                               left_tree.erase_helper(left_base(node));
+                               destroy_node(node);
+                               data.sz--;
+                           });
         return last;
     }
 
     left_iterator find_left(left_t const& left) const noexcept {
-        return left_iterator(left_tree.find(left));
+        return left_iterator(left_tree.find(left), this);
     }
+
+    template <typename K, typename C = cmp_left_t,
+              typename = typename C::is_transparent>
+    left_iterator find_left(K const& left) const noexcept {
+        return left_iterator(left_tree.find(left), this);
+    }
+
     right_iterator find_right(right_t const& right) const noexcept {
-        return right_iterator(right_tree.find(right));
+        return right_iterator(right_tree.find(right), this);
+    }
+
+    template <typename K, typename C = cmp_right_t,
+              typename = typename C::is_transparent>
+    right_iterator find_right(K const& right) const noexcept {
+        return right_iterator(right_tree.find(right), this);
     }
 
     right_t const& at_left(left_t const& key) const {
-        details::node_base* found_node = left_tree.find(key);
-        if (found_node == left_tree.end()) {
-            throw std::out_of_range("there is no such value in bimap");
-        }
-        node_t* bimap_node = &to_bimap_node<left_t, left_tag>(
-            details::base_to_tree_node<left_t, left_tag>(*found_node));
-        return bimap_node->template to_tree_node<right_t, right_tag>().value;
+        return at_left_impl(key);
+    }
+
+    template <typename K, typename C = cmp_left_t,
+              typename = typename C::is_transparent>
+    right_t const& at_left(K const& key) const {
+        return at_left_impl(key);
     }
 
     left_t const& at_right(right_t const& key) const {
-        details::node_base* found_node = right_tree.find(key);
-        if (found_node == right_tree.end()) {
-            throw std::out_of_range("there is no such value in bimap");
-        }
-        node_t* bimap_node = &to_bimap_node<right_t, right_tag>(
-            details::base_to_tree_node<right_t, right_tag>(*found_node));
-        return bimap_node->template to_tree_node<left_t, left_tag>().value;
+        return at_right_impl(key);
+    }
+
+    template <typename K, typename C = cmp_right_t,
+              typename = typename C::is_transparent>
+    left_t const& at_right(K const& key) const {
+        return at_right_impl(key);
     }
 
     template <
@@ -283,9 +931,9 @@ struct bimap {
     right_t const& at_left_or_default(left_t const& key) {
         if (left_tree.find(key) == left_tree.end()) {
             right_t default_value{};
-            details::node_base* found = right_tree.find(default_value);
+            node_base_t* found = right_tree.find(default_value);
             if (found != right_tree.end()) {
-                left_iterator it = right_iterator(found).flip();
+                left_iterator it = right_iterator(found, this).flip();
                 erase_left(it);
                 return *insert(key, std::move(default_value)).flip();
             }
@@ -299,9 +947,9 @@ struct bimap {
     left_t const& at_right_or_default(right_t const& key) {
         if (right_tree.find(key) == right_tree.end()) {
             left_t default_value{};
-            details::node_base* found = left_tree.find(default_value);
+            node_base_t* found = left_tree.find(default_value);
             if (found != right_tree.end()) {
-                right_iterator it = left_iterator(found).flip();
+                right_iterator it = left_iterator(found, this).flip();
                 erase_right(it);
                 return *insert(std::move(default_value), key);
             }
@@ -312,37 +960,125 @@ struct bimap {
     }
 
     left_iterator lower_bound_left(const left_t& left) const noexcept {
-        details::node_base* found = left_tree.lower_bound(left);
-        return left_iterator(found);
+        node_base_t* found = left_tree.lower_bound(left);
+        return left_iterator(found, this);
+    }
+
+    template <typename K, typename C = cmp_left_t,
+              typename = typename C::is_transparent>
+    left_iterator lower_bound_left(const K& left) const noexcept {
+        node_base_t* found = left_tree.lower_bound(left);
+        return left_iterator(found, this);
     }
 
     left_iterator upper_bound_left(const left_t& left) const noexcept {
-        details::node_base* found = left_tree.upper_bound(left);
-        return left_iterator(found);
+        node_base_t* found = left_tree.upper_bound(left);
+        return left_iterator(found, this);
+    }
+
+    template <typename K, typename C = cmp_left_t,
+              typename = typename C::is_transparent>
+    left_iterator upper_bound_left(const K& left) const noexcept {
+        node_base_t* found = left_tree.upper_bound(left);
+        return left_iterator(found, this);
     }
 
     right_iterator lower_bound_right(const right_t& right) const noexcept {
-        details::node_base* found = right_tree.lower_bound(right);
-        return right_iterator(found);
+        node_base_t* found = right_tree.lower_bound(right);
+        return right_iterator(found, this);
+    }
+
+    template <typename K, typename C = cmp_right_t,
+              typename = typename C::is_transparent>
+    right_iterator lower_bound_right(const K& right) const noexcept {
+        node_base_t* found = right_tree.lower_bound(right);
+        return right_iterator(found, this);
     }
 
     right_iterator upper_bound_right(const right_t& right) const noexcept {
-        details::node_base* found = right_tree.upper_bound(right);
-        return right_iterator(found);
+        node_base_t* found = right_tree.upper_bound(right);
+        return right_iterator(found, this);
+    }
+
+    template <typename K, typename C = cmp_right_t,
+              typename = typename C::is_transparent>
+    right_iterator upper_bound_right(const K& right) const noexcept {
+        node_base_t* found = right_tree.upper_bound(right);
+        return right_iterator(found, this);
+    }
+
+    template <bool Sized = order_statistics,
+              typename = std::enable_if_t<Sized>>
+    left_iterator nth_left(std::size_t k) const noexcept {
+        return left_iterator(left_tree.nth(k), this);
+    }
+
+    template <bool Sized = order_statistics,
+              typename = std::enable_if_t<Sized>>
+    right_iterator nth_right(std::size_t k) const noexcept {
+        return right_iterator(right_tree.nth(k), this);
+    }
+
+    template <bool Sized = order_statistics,
+              typename = std::enable_if_t<Sized>>
+    std::size_t rank_left(const left_t& left) const noexcept {
+        return left_tree.rank(left);
+    }
+
+    template <typename K, typename C = cmp_left_t,
+              typename = typename C::is_transparent,
+              typename = std::enable_if_t<!std::is_same_v<K, left_t>>>
+    std::size_t rank_left(const K& left) const noexcept {
+        static_assert(order_statistics,
+                      "rank_left needs subtree sizes in the policy");
+        return left_tree.rank(left);
+    }
+
+    template <bool Sized = order_statistics,
+              typename = std::enable_if_t<Sized>>
+    std::size_t rank_right(const right_t& right) const noexcept {
+        return right_tree.rank(right);
+    }
+
+    template <typename K, typename C = cmp_right_t,
+              typename = typename C::is_transparent,
+              typename = std::enable_if_t<!std::is_same_v<K, right_t>>>
+    std::size_t rank_right(const K& right) const noexcept {
+        static_assert(order_statistics,
+                      "rank_right needs subtree sizes in the policy");
+        return right_tree.rank(right);
+    }
+
+    // depth histograms of both trees and a check of their order, heap,
+    // parent link and subtree size invariants; O(n) time and O(depth)
+    // extra memory, so it can run on a live map
+    bimap_shape analyze() const {
+        bimap_shape result{left_tree.analyze(), right_tree.analyze(), false};
+        result.sizes_match = result.left.nodes == size() &&
+                             result.right.nodes == size();
+        return result;
+    }
+
+    // counters since construction and the current depths of both trees
+    template <bool Counted = instrumented,
+              typename = std::enable_if_t<Counted>>
+    bimap_stats stats() const {
+        return {left_tree.stats(), right_tree.stats(),
+                data.allocations.load(), data.frees.load()};
     }
 
     left_iterator begin_left() const noexcept {
-        return left_iterator(left_tree.begin());
+        return left_iterator(left_tree.begin(), this);
     }
     left_iterator end_left() const noexcept {
-        return left_iterator(left_tree.end());
+        return left_iterator(left_tree.end(), this);
     }
 
     right_iterator begin_right() const noexcept {
-        return right_iterator(right_tree.begin());
+        return right_iterator(right_tree.begin(), this);
     }
     right_iterator end_right() const noexcept {
-        return right_iterator(right_tree.end());
+        return right_iterator(right_tree.end(), this);
     }
 
     bool empty() const noexcept {
@@ -350,7 +1086,11 @@ struct bimap {
     }
 
     std::size_t size() const noexcept {
-        return sz;
+        return data.sz;
+    }
+
+    allocator_type get_allocator() const noexcept {
+        return allocator_type(node_allocator());
     }
 
     bool operator==(bimap const& b) const noexcept {
@@ -380,7 +1120,533 @@ struct bimap {
     }
 
   private:
-    details::tree<left_t, cmp_left_t, left_tag> left_tree;
-    details::tree<right_t, cmp_right_t, right_tag> right_tree;
-    size_t sz{0};
+    template <typename Tag>
+    auto const& tree_of() const noexcept {
+        if constexpr (std::is_same_v<Tag, left_tag>) {
+            return left_tree;
+        } else {
+            return right_tree;
+        }
+    }
+
+    struct allocator_holder : node_allocator_t,
+                              Policy::statistics::node_counters,
+                              details::home_slot<bimap, !has_parent> {
+        explicit allocator_holder(node_allocator_t&& alloc) noexcept
+            : node_allocator_t(std::move(alloc)) {}
+
+        std::size_t sz{0};
+    };
+
+    node_allocator_t& node_allocator() noexcept {
+        return static_cast<node_allocator_t&>(data);
+    }
+
+    node_allocator_t const& node_allocator() const noexcept {
+        return static_cast<node_allocator_t const&>(data);
+    }
+
+    using home_t = details::owner_home<bimap>;
+    using home_allocator_t = typename std::allocator_traits<
+        allocator_type>::template rebind_alloc<home_t>;
+    using home_allocator_traits = std::allocator_traits<home_allocator_t>;
+
+    home_t const* get_home() const noexcept {
+        if constexpr (has_parent) {
+            return nullptr;
+        } else {
+            return data.home;
+        }
+    }
+
+    // made along with the first node, after it, so an empty map allocates
+    // nothing and a pool sizes its blocks for nodes
+    void make_home() {
+        if constexpr (!has_parent) {
+            if (data.home == nullptr) {
+                home_allocator_t alloc(node_allocator());
+                data.home = home_allocator_traits::allocate(alloc, 1);
+                home_allocator_traits::construct(alloc, data.home,
+                                                 home_t{this});
+            }
+        }
+    }
+
+    void adopt_home() noexcept {
+        if constexpr (!has_parent) {
+            if (data.home != nullptr) {
+                data.home->owner = this;
+            }
+        }
+    }
+
+    void free_home() noexcept {
+        if constexpr (!has_parent) {
+            if (data.home != nullptr) {
+                home_allocator_t alloc(node_allocator());
+                home_allocator_traits::destroy(alloc, data.home);
+                home_allocator_traits::deallocate(alloc, data.home, 1);
+                data.home = nullptr;
+            }
+        }
+    }
+
+    template <typename... Args>
+    node_t* create_node(Args&&... args) {
+        node_t* new_node = node_allocator_traits::allocate(node_allocator(), 1);
+        if constexpr (instrumented) {
+            data.allocations.add();
+        }
+        try {
+            make_home();
+            node_allocator_traits::construct(node_allocator(), new_node,
+                                             std::forward<Args>(args)...);
+        } catch (...) {
+            destroy_storage(new_node);
+            throw;
+        }
+        return new_node;
+    }
+
+    void destroy_node(node_t* v) noexcept {
+        node_allocator_traits::destroy(node_allocator(), v);
+        destroy_storage(v);
+    }
+
+    void destroy_storage(node_t* v) noexcept {
+        node_allocator_traits::deallocate(node_allocator(), v, 1);
+        if constexpr (instrumented) {
+            data.frees.add();
+        }
+    }
+
+    // the node is dropped if either key is already present; a right side
+    // duplicate unlinks it from the left tree again
+    left_iterator link_node(node_t* new_node) noexcept {
+        std::pair<node_base_t*, bool> left = left_tree.insert(
+            &new_node->template to_tree_node<left_t, left_tag>());
+        if (!left.second) {
+            destroy_node(new_node);
+            return end_left();
+        }
+        if (!right_tree
+                 .insert(&new_node->template to_tree_node<right_t, right_tag>())
+                 .second) {
+            left_tree.erase_helper(left.first);
+            destroy_node(new_node);
+            return end_left();
+        }
+        data.sz++;
+        return left_iterator(left.first, this);
+    }
+
+    // the end of a compact iterator is nullptr rather than the sentinel
+    template <typename Iterator>
+    static node_base_t* tree_node_of(Iterator const& it) noexcept {
+        if constexpr (has_parent) {
+            return it.ptr;
+        } else {
+            return it.to_tree(it.ptr);
+        }
+    }
+
+    bool erase_found(left_iterator it) noexcept {
+        if (it == end_left()) {
+            return false;
+        }
+        erase_left(it);
+        return true;
+    }
+
+    template <typename K>
+    right_t const& at_left_impl(K const& key) const {
+        node_base_t* found_node = left_tree.find(key);
+        if (found_node == left_tree.end()) {
+            throw std::out_of_range("there is no such value in bimap");
+        }
+        node_t* bimap_node = &to_bimap_node<left_t, left_tag>(
+            details::base_to_tree_node<left_t, left_tag, Policy>(*found_node));
+        return bimap_node->template to_tree_node<right_t, right_tag>().value;
+    }
+
+    template <typename K>
+    left_t const& at_right_impl(K const& key) const {
+        node_base_t* found_node = right_tree.find(key);
+        if (found_node == right_tree.end()) {
+            throw std::out_of_range("there is no such value in bimap");
+        }
+        node_t* bimap_node = &to_bimap_node<right_t, right_tag>(
+            details::base_to_tree_node<right_t, right_tag, Policy>(
+                *found_node));
+        return bimap_node->template to_tree_node<left_t, left_tag>().value;
+    }
+
+    void destroy_nodes(std::vector<node_t*> const& nodes) noexcept {
+        for (node_t* v : nodes) {
+            destroy_node(v);
+        }
+    }
+
+    static node_base_t* left_base(node_t* v) noexcept {
+        return &details::to_base<left_t, left_tag, Policy>(
+            v->template to_tree_node<left_t, left_tag>());
+    }
+
+    static node_base_t* right_base(node_t* v) noexcept {
+        return &details::to_base<right_t, right_tag, Policy>(
+            v->template to_tree_node<right_t, right_tag>());
+    }
+
+    static node_t* from_left_base(node_base_t* v) noexcept {
+        return &to_bimap_node<left_t, left_tag>(
+            details::base_to_tree_node<left_t, left_tag, Policy>(*v));
+    }
+
+    static node_t* from_right_base(node_base_t* v) noexcept {
+        return &to_bimap_node<right_t, right_tag>(
+            details::base_to_tree_node<right_t, right_tag, Policy>(*v));
+    }
+
+    static left_t const& left_value(node_t* v) noexcept {
+        return v->template to_tree_node<left_t, left_tag>().value;
+    }
+
+    static right_t const& right_value(node_t* v) noexcept {
+        return v->template to_tree_node<right_t, right_tag>().value;
+    }
+
+    template <typename InputIt>
+    void fill_sorted(InputIt first, InputIt last) {
+        std::vector<node_t*> nodes = create_nodes(first, last);
+        link_sorted(nodes, false);
+    }
+
+    // both key orders are sorted at once; a right key shared by several
+    // pairs stays with the smallest left key, as link_sorted does
+    template <typename InputIt>
+    void fill_parallel(InputIt first, InputIt last, unsigned threads) {
+        std::vector<node_t*> nodes = create_nodes(first, last);
+        std::size_t n = nodes.size();
+        auto left_less = [this, &nodes](std::size_t a, std::size_t b) {
+            return left_tree.less(left_value(nodes[a]), left_value(nodes[b]));
+        };
+        auto right_less = [this, &nodes](std::size_t a, std::size_t b) {
+            return right_tree.less(right_value(nodes[a]),
+                                   right_value(nodes[b]));
+        };
+        std::vector<std::size_t> left_order;
+        std::vector<std::size_t> right_order;
+        std::vector<char> dropped;
+        std::vector<node_base_t*> left_bases;
+        std::vector<node_base_t*> right_bases;
+        try {
+            left_order.resize(n);
+            right_order.resize(n);
+            dropped.resize(n, false);
+            left_bases.reserve(n);
+            right_bases.reserve(n);
+        } catch (...) {
+            destroy_nodes(nodes);
+            throw;
+        }
+        std::iota(left_order.begin(), left_order.end(), 0);
+        std::iota(right_order.begin(), right_order.end(), 0);
+        details::fork_join(
+            threads,
+            [&] {
+                details::parallel_sort(left_order.begin(), left_order.end(),
+                                       left_less, threads / 2);
+            },
+            [&] {
+                details::parallel_sort(right_order.begin(), right_order.end(),
+                                       right_less, threads - threads / 2);
+            });
+
+        for (std::size_t k = 1; k < n; k++) {
+            if (!left_less(left_order[k - 1], left_order[k])) {
+                dropped[left_order[k]] = true;
+            }
+        }
+        std::size_t run_begin = 0;
+        for (std::size_t k = 1; k <= n; k++) {
+            if (k != n && !right_less(right_order[k - 1], right_order[k])) {
+                continue;
+            }
+            std::size_t kept = n;
+            for (std::size_t j = run_begin; j < k; j++) {
+                std::size_t i = right_order[j];
+                if (dropped[i]) {
+                    continue;
+                }
+                if (kept == n || left_less(i, kept)) {
+                    if (kept != n) {
+                        dropped[kept] = true;
+                    }
+                    kept = i;
+                } else {
+                    dropped[i] = true;
+                }
+            }
+            run_begin = k;
+        }
+
+        for (std::size_t i : left_order) {
+            if (!dropped[i]) {
+                left_bases.push_back(left_base(nodes[i]));
+            }
+        }
+        for (std::size_t i : right_order) {
+            if (!dropped[i]) {
+                right_bases.push_back(right_base(nodes[i]));
+            }
+        }
+        details::fork_join(
+            threads,
+            [&] {
+                left_tree.build_parallel(left_bases.begin(), left_bases.end(),
+                                         threads / 2);
+            },
+            [&] {
+                right_tree.build_parallel(right_bases.begin(),
+                                          right_bases.end(),
+                                          threads - threads / 2);
+            });
+        for (std::size_t i = 0; i < n; i++) {
+            if (dropped[i]) {
+                destroy_node(nodes[i]);
+            }
+        }
+        data.sz = left_bases.size();
+    }
+
+    // the payload is produced twice, once for the checksum in the header
+    // and once for sink, so it never has to be held in memory
+    template <typename Sink>
+    void write_snapshot(Sink&& sink) const {
+        std::vector<node_t*> by_left;
+        std::vector<node_t*> by_right;
+        by_left.reserve(size());
+        by_right.reserve(size());
+        for (node_base_t* v = left_tree.begin(); v != left_tree.end();
+             v = left_tree.next(v)) {
+            by_left.push_back(from_left_base(v));
+        }
+        for (node_base_t* v = right_tree.begin(); v != right_tree.end();
+             v = right_tree.next(v)) {
+            by_right.push_back(from_right_base(v));
+        }
+        std::vector<std::size_t> by_address(by_left.size());
+        std::iota(by_address.begin(), by_address.end(), 0);
+        std::sort(by_address.begin(), by_address.end(),
+                  [&by_left](std::size_t a, std::size_t b) {
+                      return std::less<node_t*>()(by_left[a], by_left[b]);
+                  });
+        std::vector<uint64_t> left_partners(by_left.size());
+        std::vector<uint64_t> right_partners;
+        right_partners.reserve(by_right.size());
+        for (node_t* node : by_right) {
+            std::size_t i = *std::lower_bound(
+                by_address.begin(), by_address.end(), node,
+                [&by_left](std::size_t i, node_t* u) {
+                    return std::less<node_t*>()(by_left[i], u);
+                });
+            left_partners[i] = right_partners.size();
+            right_partners.push_back(i);
+        }
+
+        details::snapshot_layout layout(sizeof(left_t), sizeof(right_t),
+                                        size());
+        auto payload = [&](auto&& put) {
+            std::size_t offset = sizeof(details::snapshot_header);
+            char const zeros[details::snapshot_header::section_alignment]{};
+            auto pad_to = [&](std::size_t section) {
+                put(zeros, section - offset);
+                offset = section;
+            };
+            pad_to(layout.lefts);
+            for (node_t* v : by_left) {
+                put(&left_value(v), sizeof(left_t));
+            }
+            offset += by_left.size() * sizeof(left_t);
+            pad_to(layout.rights);
+            for (node_t* v : by_right) {
+                put(&right_value(v), sizeof(right_t));
+            }
+            offset += by_right.size() * sizeof(right_t);
+            pad_to(layout.left_partners);
+            put(left_partners.data(), left_partners.size() * sizeof(uint64_t));
+            offset += left_partners.size() * sizeof(uint64_t);
+            pad_to(layout.right_partners);
+            put(right_partners.data(),
+                right_partners.size() * sizeof(uint64_t));
+        };
+        details::snapshot_checksum checksum;
+        payload([&checksum](void const* bytes, std::size_t n) {
+            checksum.update(bytes, n);
+        });
+        details::snapshot_header header{};
+        std::memcpy(header.magic, details::snapshot_header::expected_magic,
+                    sizeof(header.magic));
+        header.version = details::snapshot_header::current_version;
+        header.byte_order = details::snapshot_header::host_byte_order;
+        header.left_size = sizeof(left_t);
+        header.right_size = sizeof(right_t);
+        header.count = size();
+        header.checksum = checksum.value();
+
+        constexpr std::size_t buffer_size = 1 << 16;
+        std::vector<char> buffer;
+        buffer.reserve(buffer_size);
+        auto put = [&](void const* bytes, std::size_t n) {
+            auto const* first = static_cast<char const*>(bytes);
+            if (buffer.size() + n > buffer_size) {
+                sink(buffer.data(), buffer.size());
+                buffer.clear();
+            }
+            if (n >= buffer_size) {
+                sink(first, n);
+            } else {
+                buffer.insert(buffer.end(), first, first + n);
+            }
+        };
+        put(&header, sizeof(header));
+        payload(put);
+        sink(buffer.data(), buffer.size());
+    }
+
+    // a bad file is rejected before the first node is created
+    void fill_snapshot(char const* bytes, std::size_t size) {
+        details::snapshot_layout layout = details::check_snapshot_header(
+            bytes, size, sizeof(left_t), sizeof(right_t));
+        details::check_snapshot_checksum(bytes, layout);
+        details::check_snapshot_order<left_t, right_t>(
+            bytes, layout, left_tree.cmp(), right_tree.cmp());
+
+        std::size_t n = layout.count;
+        std::vector<node_t*> nodes;
+        std::vector<node_base_t*> bases;
+        try {
+            nodes.reserve(n);
+            bases.reserve(n);
+            for (std::size_t i = 0; i < n; i++) {
+                uint64_t j = details::read_flat<uint64_t>(
+                    bytes + layout.left_partners + i * sizeof(uint64_t));
+                nodes.push_back(create_node(
+                    details::read_flat<left_t>(bytes + layout.lefts +
+                                               i * sizeof(left_t)),
+                    details::read_flat<right_t>(bytes + layout.rights +
+                                                j * sizeof(right_t))));
+            }
+        } catch (...) {
+            destroy_nodes(nodes);
+            throw;
+        }
+        for (std::size_t j = 0; j < n; j++) {
+            uint64_t i = details::read_flat<uint64_t>(
+                bytes + layout.right_partners + j * sizeof(uint64_t));
+            bases.push_back(right_base(nodes[i]));
+        }
+        right_tree.build(bases.begin(), bases.end());
+        bases.clear();
+        for (node_t* v : nodes) {
+            bases.push_back(left_base(v));
+        }
+        left_tree.build(bases.begin(), bases.end());
+        data.sz = n;
+    }
+
+    template <typename InputIt>
+    std::vector<node_t*> create_nodes(InputIt first, InputIt last) {
+        std::vector<node_t*> nodes;
+        if constexpr (std::is_base_of_v<
+                          std::forward_iterator_tag,
+                          typename std::iterator_traits<
+                              InputIt>::iterator_category>) {
+            nodes.reserve(std::distance(first, last));
+        }
+        try {
+            for (; first != last; ++first) {
+                auto&& p = *first;
+                nodes.push_back(
+                    create_node(std::forward<decltype(p)>(p).first,
+                                std::forward<decltype(p)>(p).second));
+            }
+        } catch (...) {
+            destroy_nodes(nodes);
+            throw;
+        }
+        return nodes;
+    }
+
+    // stable, so of the pairs sharing a left key the first one is kept
+    void sort_by_left(std::vector<node_t*>& nodes) {
+        auto left_less = [this](node_t* a, node_t* b) {
+            return left_tree.less(left_value(a), left_value(b));
+        };
+        if (!std::is_sorted(nodes.begin(), nodes.end(), left_less)) {
+            std::stable_sort(nodes.begin(), nodes.end(), left_less);
+        }
+        std::size_t kept = 0;
+        for (node_t* v : nodes) {
+            if (kept != 0 && !left_less(nodes[kept - 1], v)) {
+                destroy_node(v);
+            } else {
+                nodes[kept++] = v;
+            }
+        }
+        nodes.resize(kept);
+    }
+
+    // nodes come in left order; unless unique is set, out-of-order input is
+    // sorted and pairs repeating an earlier left or right key are dropped
+    void link_sorted(std::vector<node_t*>& nodes, bool unique) {
+        if (!unique) {
+            sort_by_left(nodes);
+        }
+
+        std::vector<std::size_t> right_order;
+        std::vector<node_base_t*> bases;
+        try {
+            right_order.resize(nodes.size());
+            bases.reserve(nodes.size());
+        } catch (...) {
+            destroy_nodes(nodes);
+            throw;
+        }
+        std::iota(right_order.begin(), right_order.end(), 0);
+        std::stable_sort(right_order.begin(), right_order.end(),
+                         [this, &nodes](std::size_t a, std::size_t b) {
+                             return right_tree.less(right_value(nodes[a]),
+                                                    right_value(nodes[b]));
+                         });
+
+        node_t* last_kept = nullptr;
+        for (std::size_t i : right_order) {
+            if (!unique && last_kept != nullptr &&
+                !right_tree.less(right_value(last_kept),
+                                 right_value(nodes[i]))) {
+                destroy_node(nodes[i]);
+                nodes[i] = nullptr;
+                continue;
+            }
+            last_kept = nodes[i];
+            bases.push_back(&details::to_base<right_t, right_tag, Policy>(
+                nodes[i]->template to_tree_node<right_t, right_tag>()));
+        }
+        right_tree.build(bases.begin(), bases.end());
+
+        bases.clear();
+        for (node_t* v : nodes) {
+            if (v != nullptr) {
+                bases.push_back(&details::to_base<left_t, left_tag, Policy>(
+                    v->template to_tree_node<left_t, left_tag>()));
+            }
+        }
+        left_tree.build(bases.begin(), bases.end());
+        data.sz = bases.size();
+    }
+
+    left_tree_t left_tree;
+    right_tree_t right_tree;
+    allocator_holder data;
 };
@@ -0,0 +1,380 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "bimap.h"
+#include "test-classes.h"
+
+#ifndef BIMAP_BENCH_MAX_SIZE
+#define BIMAP_BENCH_MAX_SIZE 1000000
+#endif
+
+namespace {
+
+// key i of a type; even ids are stored, odd ones are misses
+template <typename K>
+K make_key(uint32_t id);
+
+template <>
+int make_key<int>(uint32_t id) {
+    return static_cast<int>(id);
+}
+
+template <>
+std::string make_key<std::string>(uint32_t id) {
+    std::string digits = std::to_string(id);
+    return "user-" + std::string(10 - digits.size(), '0') + digits;
+}
+
+template <>
+test_object make_key<test_object>(uint32_t id) {
+    return test_object(static_cast<int>(id));
+}
+
+template <typename K>
+struct bimap_adapter {
+    static constexpr bool bidirectional = true;
+
+    void insert(uint32_t left, uint32_t right) {
+        map.insert(make_key<K>(left), make_key<K>(right));
+    }
+
+    bool find_left(K const& key) const {
+        return map.find_left(key) != map.end_left();
+    }
+
+    bool find_right(K const& key) const {
+        return map.find_right(key) != map.end_right();
+    }
+
+    bool lower_bound(K const& key) const {
+        return map.lower_bound_left(key) != map.end_left();
+    }
+
+    bool upper_bound(K const& key) const {
+        return map.upper_bound_left(key) != map.end_left();
+    }
+
+    std::size_t walk() const {
+        std::size_t visited = 0;
+        for (auto it = map.begin_left(); it != map.end_left(); ++it) {
+            benchmark::DoNotOptimize(&*it.flip());
+            visited++;
+        }
+        return visited;
+    }
+
+    void erase_left(K const& key) {
+        map.erase_left(key);
+    }
+
+    bimap<K, K> map;
+};
+
+// what a bimap built from two maps, as boost::bimap users often
+// hand-roll, costs
+template <typename K>
+struct two_map_adapter {
+    static constexpr bool bidirectional = true;
+
+    void insert(uint32_t left, uint32_t right) {
+        if (lefts.count(make_key<K>(left)) != 0 ||
+            rights.count(make_key<K>(right)) != 0) {
+            return;
+        }
+        lefts.emplace(make_key<K>(left), make_key<K>(right));
+        rights.emplace(make_key<K>(right), make_key<K>(left));
+    }
+
+    bool find_left(K const& key) const {
+        return lefts.find(key) != lefts.end();
+    }
+
+    bool find_right(K const& key) const {
+        return rights.find(key) != rights.end();
+    }
+
+    bool lower_bound(K const& key) const {
+        return lefts.lower_bound(key) != lefts.end();
+    }
+
+    bool upper_bound(K const& key) const {
+        return lefts.upper_bound(key) != lefts.end();
+    }
+
+    std::size_t walk() const {
+        std::size_t visited = 0;
+        for (auto it = lefts.begin(); it != lefts.end(); ++it) {
+            benchmark::DoNotOptimize(&rights.find(it->second)->first);
+            visited++;
+        }
+        return visited;
+    }
+
+    void erase_left(K const& key) {
+        auto it = lefts.find(key);
+        if (it != lefts.end()) {
+            rights.erase(it->second);
+            lefts.erase(it);
+        }
+    }
+
+    std::map<K, K> lefts;
+    std::map<K, K> rights;
+};
+
+// one direction only: the floor for the left side operations
+template <typename K>
+struct map_adapter {
+    static constexpr bool bidirectional = false;
+
+    void insert(uint32_t left, uint32_t right) {
+        map.emplace(make_key<K>(left), make_key<K>(right));
+    }
+
+    bool find_left(K const& key) const {
+        return map.find(key) != map.end();
+    }
+
+    bool find_right(K const&) const {
+        return false;
+    }
+
+    bool lower_bound(K const& key) const {
+        return map.lower_bound(key) != map.end();
+    }
+
+    bool upper_bound(K const& key) const {
+        return map.upper_bound(key) != map.end();
+    }
+
+    std::size_t walk() const {
+        std::size_t visited = 0;
+        for (auto it = map.begin(); it != map.end(); ++it) {
+            benchmark::DoNotOptimize(&it->second);
+            visited++;
+        }
+        return visited;
+    }
+
+    void erase_left(K const& key) {
+        map.erase(key);
+    }
+
+    std::map<K, K> map;
+};
+
+enum class order { random, sorted, reversed };
+
+// pair i is (2 * i, 2 * (n - 1 - i)), so the sides are ordered differently
+std::vector<uint32_t> insertion_order(uint32_t n, order o) {
+    std::vector<uint32_t> ids(n);
+    for (uint32_t i = 0; i < n; i++) {
+        ids[i] = i;
+    }
+    if (o == order::random) {
+        std::shuffle(ids.begin(), ids.end(), std::mt19937(n));
+    } else if (o == order::reversed) {
+        std::reverse(ids.begin(), ids.end());
+    }
+    return ids;
+}
+
+template <typename Map>
+void fill(Map& map, uint32_t n) {
+    for (uint32_t i : insertion_order(n, order::random)) {
+        map.insert(2 * i, 2 * (n - 1 - i));
+    }
+}
+
+template <typename K>
+std::vector<K> lookup_keys(uint32_t n, bool hit) {
+    std::vector<K> keys;
+    keys.reserve(n);
+    for (uint32_t i : insertion_order(n, order::random)) {
+        keys.push_back(make_key<K>(2 * i + (hit ? 0 : 1)));
+    }
+    return keys;
+}
+
+template <typename Map>
+void insert(benchmark::State& state, order o) {
+    uint32_t n = static_cast<uint32_t>(state.range(0));
+    std::vector<uint32_t> ids = insertion_order(n, o);
+    for (auto _ : state) {
+        Map map;
+        for (uint32_t i : ids) {
+            map.insert(2 * i, 2 * (n - 1 - i));
+        }
+        state.PauseTiming();
+        {
+            Map dying = std::move(map);
+        }
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename Map, typename K>
+void find(benchmark::State& state, bool right, bool hit) {
+    uint32_t n = static_cast<uint32_t>(state.range(0));
+    Map map;
+    fill(map, n);
+    std::vector<K> keys = lookup_keys<K>(n, hit);
+    std::size_t j = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(right ? map.find_right(keys[j])
+                                       : map.find_left(keys[j]));
+        if (++j == keys.size()) {
+            j = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template <typename Map, typename K>
+void bound(benchmark::State& state, bool upper) {
+    uint32_t n = static_cast<uint32_t>(state.range(0));
+    Map map;
+    fill(map, n);
+    std::vector<K> keys = lookup_keys<K>(n, false);
+    std::size_t j = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(upper ? map.upper_bound(keys[j])
+                                       : map.lower_bound(keys[j]));
+        if (++j == keys.size()) {
+            j = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template <typename Map>
+void iterate(benchmark::State& state) {
+    uint32_t n = static_cast<uint32_t>(state.range(0));
+    Map map;
+    fill(map, n);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(map.walk());
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename Map>
+void copy(benchmark::State& state) {
+    uint32_t n = static_cast<uint32_t>(state.range(0));
+    Map map;
+    fill(map, n);
+    for (auto _ : state) {
+        Map copied = map;
+        benchmark::DoNotOptimize(&copied);
+        state.PauseTiming();
+        {
+            Map dying = std::move(copied);
+        }
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename Map>
+void destroy(benchmark::State& state) {
+    uint32_t n = static_cast<uint32_t>(state.range(0));
+    for (auto _ : state) {
+        state.PauseTiming();
+        {
+            Map map;
+            fill(map, n);
+            state.ResumeTiming();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// erases a present pair and puts it back, keeping the size steady
+template <typename Map, typename K>
+void erase_mix(benchmark::State& state) {
+    uint32_t n = static_cast<uint32_t>(state.range(0));
+    Map map;
+    fill(map, n);
+    std::vector<uint32_t> ids = insertion_order(n, order::random);
+    std::vector<K> keys = lookup_keys<K>(n, true);
+    std::size_t j = 0;
+    for (auto _ : state) {
+        map.erase_left(keys[j]);
+        map.insert(2 * ids[j], 2 * (n - 1 - ids[j]));
+        if (++j == keys.size()) {
+            j = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template <typename F>
+void add(std::string const& name, F f) {
+    benchmark::RegisterBenchmark(name.c_str(), f)
+        ->RangeMultiplier(10)
+        ->Range(1000, BIMAP_BENCH_MAX_SIZE);
+}
+
+template <template <typename> class Adapter, typename K>
+void register_all(std::string const& container, std::string const& key) {
+    using map_t = Adapter<K>;
+    std::string suffix = "<" + container + ", " + key + ">";
+    add("insert_random" + suffix,
+        [](benchmark::State& s) { insert<map_t>(s, order::random); });
+    add("insert_sorted" + suffix,
+        [](benchmark::State& s) { insert<map_t>(s, order::sorted); });
+    add("insert_reversed" + suffix,
+        [](benchmark::State& s) { insert<map_t>(s, order::reversed); });
+    add("find_left_hit" + suffix,
+        [](benchmark::State& s) { find<map_t, K>(s, false, true); });
+    add("find_left_miss" + suffix,
+        [](benchmark::State& s) { find<map_t, K>(s, false, false); });
+    if constexpr (map_t::bidirectional) {
+        add("find_right_hit" + suffix,
+            [](benchmark::State& s) { find<map_t, K>(s, true, true); });
+        add("find_right_miss" + suffix,
+            [](benchmark::State& s) { find<map_t, K>(s, true, false); });
+    }
+    add("lower_bound" + suffix,
+        [](benchmark::State& s) { bound<map_t, K>(s, false); });
+    add("upper_bound" + suffix,
+        [](benchmark::State& s) { bound<map_t, K>(s, true); });
+    add("iterate_flip" + suffix, iterate<map_t>);
+    if constexpr (std::is_copy_constructible_v<K>) {
+        add("copy" + suffix, copy<map_t>);
+    }
+    add("destroy" + suffix, destroy<map_t>);
+    add("erase_mix" + suffix, erase_mix<map_t, K>);
+}
+
+template <typename K>
+void register_key(std::string const& key) {
+    register_all<bimap_adapter, K>("bimap", key);
+    register_all<two_map_adapter, K>("two_maps", key);
+    register_all<map_adapter, K>("std::map", key);
+}
+} // namespace
+
+// run with --benchmark_out=<file> --benchmark_out_format=json for a
+// report to diff against an earlier run
+int main(int argc, char** argv) {
+    register_key<int>("int");
+    register_key<std::string>("string");
+    register_key<test_object>("test_object");
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
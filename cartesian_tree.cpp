@@ -1,14 +1,37 @@
 #include "cartesian_tree.h"
+#include <atomic>
 
-static std::mt19937 rnd;
+namespace {
+// each thread starts at its own point of the sequence; threads drawing the
+// same priorities would build correlated treaps that fork_join and merge
+// then combine
+uint64_t initial_priority_state() noexcept {
+    static std::atomic<uint64_t> threads{0};
+    uint64_t z = 0x853c49e6748fea9bULL +
+                 threads.fetch_add(1, std::memory_order_relaxed) *
+                     0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+} // namespace
+
+static thread_local uint64_t priority_state = initial_priority_state();
 
 uint32_t details::get_next_random_uint32_t() {
-    return static_cast<uint32_t>(rnd());
+    uint64_t z = (priority_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return static_cast<uint32_t>((z ^ (z >> 31)) >> 32);
+}
+
+void details::seed_priorities(uint64_t seed) noexcept {
+    priority_state = seed;
 }
 
 void details::actualize_children_parents(details::node_base& x, details::node_base& y) noexcept {
-    std::swap(x.left->parent, y.left->parent);
-    std::swap(x.right->parent, y.right->parent);
+    set_parent(x.left, &y);
+    set_parent(y.left, &x);
 }
 
 void details::swap_sentinel(details::node_base& x, details::node_base& y) noexcept {
@@ -16,7 +39,6 @@ void details::swap_sentinel(details::node_base& x, details::node_base& y) noexce
     std::swap(x.left, y.left);
     std::swap(x.right, y.right);
     std::swap(x.parent, y.parent);
-    std::swap(x.priority, y.priority);
 }
 
 void details::set_parent(details::node_base* node, details::node_base* parent) noexcept {
@@ -1,10 +1,19 @@
 #pragma once
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
-#include <random>
+#include <string>
+#include <string_view>
+#include <tuple>
 #include <type_traits>
+#include <utility>
+#include <vector>
 
 template <typename Left, typename Right, typename CompareLeft,
-          typename CompareRight>
+          typename CompareRight, typename Allocator, typename Policy>
 struct bimap;
 
 namespace details {
@@ -13,14 +22,180 @@ template <typename left_it, typename right_it, typename left_it_tag,
           typename right_it_tag>
 struct base_iterator;
 
-template <typename T, typename Comparator, typename Tag>
+template <typename T, typename Comparator, typename Tag, typename Policy>
 struct tree;
 
-template <typename T, typename Comparator>
+template <typename T, typename Tag, typename Policy>
 struct tree_node;
 
 uint32_t get_next_random_uint32_t();
 
+void seed_priorities(uint64_t seed) noexcept;
+
+inline uint32_t mix_priority(uint64_t x) noexcept {
+    x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdULL;
+    x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+    return static_cast<uint32_t>((x ^ (x >> 33)) >> 32);
+}
+
+struct stored_priority {
+    struct node_data {
+        uint32_t priority{get_next_random_uint32_t()};
+    };
+
+    template <typename Node>
+    static uint32_t get(Node const& v) noexcept {
+        return v.priority;
+    }
+};
+
+struct address_hashed_priority {
+    struct node_data {};
+
+    template <typename Node>
+    static uint32_t get(Node const& v) noexcept {
+        return mix_priority(reinterpret_cast<uintptr_t>(&v));
+    }
+};
+
+struct key_hashed_priority {
+    struct node_data {};
+
+    template <typename Node>
+    static uint32_t get(Node const& v) noexcept {
+        using value_t = std::remove_const_t<decltype(v.value)>;
+        return mix_priority(std::hash<value_t>()(v.value));
+    }
+};
+
+struct no_subtree_size {
+    static constexpr bool enabled = false;
+
+    struct node_data {};
+};
+
+struct subtree_size {
+    static constexpr bool enabled = true;
+
+    struct node_data {
+        std::size_t size{1};
+    };
+};
+
+// bumped from const lookups, possibly on several threads at once
+struct relaxed_counter {
+    void add(uint64_t n = 1) const noexcept {
+        value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t load() const noexcept {
+        return value.load(std::memory_order_relaxed);
+    }
+
+    mutable std::atomic<uint64_t> value{0};
+};
+
+struct no_statistics {
+    static constexpr bool enabled = false;
+
+    struct tree_counters {};
+    struct node_counters {};
+};
+
+// comparisons count the keys a descent looked at
+struct tree_statistics {
+    static constexpr bool enabled = true;
+
+    struct tree_counters {
+        relaxed_counter finds;
+        relaxed_counter find_comparisons;
+        relaxed_counter searches;
+        relaxed_counter search_comparisons;
+        relaxed_counter splits;
+        relaxed_counter split_comparisons;
+        relaxed_counter merges;
+        relaxed_counter rotations;
+        relaxed_counter hint_steps;
+    };
+
+    struct node_counters {
+        relaxed_counter allocations;
+        relaxed_counter frees;
+    };
+};
+
+// node counts by depth, the root being at depth 1, and which invariants
+// hold
+struct tree_shape {
+    std::size_t nodes{0};
+    std::vector<std::size_t> depths;
+    std::vector<std::size_t> leaf_depths;
+    bool ordered{true};
+    bool heap_ordered{true};
+    bool parents_linked{true};
+    bool sizes_consistent{true};
+
+    bool valid() const noexcept {
+        return ordered && heap_ordered && parents_linked && sizes_consistent;
+    }
+};
+
+struct tree_stats {
+    uint64_t finds;
+    uint64_t find_comparisons;
+    uint64_t searches;
+    uint64_t search_comparisons;
+    uint64_t splits;
+    uint64_t split_comparisons;
+    uint64_t merges;
+    uint64_t rotations;
+    uint64_t hint_steps;
+    std::size_t max_depth;
+    double average_depth;
+};
+
+template <typename Comparator, typename T, typename = void>
+struct is_ordering_comparator : std::false_type {};
+
+template <typename Comparator, typename T>
+struct is_ordering_comparator<
+    Comparator, T,
+    std::enable_if_t<!std::is_convertible_v<
+        std::invoke_result_t<Comparator const&, T const&, T const&>, bool>>>
+    : std::true_type {};
+
+// only the standard strings are known to have a compare() that agrees with
+// their operator<
+template <typename T>
+struct is_standard_string : std::false_type {};
+
+template <typename Char, typename Traits, typename Alloc>
+struct is_standard_string<std::basic_string<Char, Traits, Alloc>>
+    : std::true_type {};
+
+template <typename Char, typename Traits>
+struct is_standard_string<std::basic_string_view<Char, Traits>>
+    : std::true_type {};
+
+template <typename T, typename K, typename = void>
+struct has_compare_member : std::false_type {};
+
+template <typename T, typename K>
+struct has_compare_member<
+    T, K,
+    std::void_t<decltype(int(
+        std::declval<T const&>().compare(std::declval<K const&>())))>>
+    : std::true_type {};
+
+template <typename Comparator>
+struct standard_order : std::integral_constant<int, 0> {};
+
+template <typename X>
+struct standard_order<std::less<X>> : std::integral_constant<int, 1> {};
+
+template <typename X>
+struct standard_order<std::greater<X>> : std::integral_constant<int, -1> {};
+
 struct node_base {
 
     node_base() = default;
@@ -35,14 +210,14 @@ struct node_base {
 
     friend node_base* get_rightmost(node_base* v) noexcept;
 
-    template <typename T, typename Comparator, typename Tag>
+    template <typename T, typename Comparator, typename Tag, typename Policy>
     friend struct tree;
 
-    template <typename T, typename Tag>
+    template <typename T, typename Tag, typename Policy>
     friend struct tree_node;
 
     template <typename Left, typename Right, typename CompareLeft,
-              typename CompareRight>
+              typename CompareRight, typename Allocator, typename Policy>
     friend struct ::bimap;
 
     friend void set_parent(node_base* node, node_base* parent) noexcept;
@@ -55,40 +230,124 @@ struct node_base {
     node_base* left{nullptr};
     node_base* right{nullptr};
     node_base* parent{nullptr};
-    uint32_t priority{get_next_random_uint32_t()};
 };
 
-template <typename T, typename Tag>
-struct tree_node : node_base {
+struct compact_node_base {
+
+    compact_node_base() = default;
+    compact_node_base(const compact_node_base&) = delete;
+    compact_node_base(compact_node_base&& other) = default;
+
+    template <typename T, typename Comparator, typename Tag, typename Policy>
+    friend struct tree;
+
+    template <typename Left, typename Right, typename CompareLeft,
+              typename CompareRight, typename Allocator, typename Policy>
+    friend struct ::bimap;
+
+  private:
+    compact_node_base* left{nullptr};
+    compact_node_base* right{nullptr};
+};
+
+struct parent_layout {
+    using node_base = details::node_base;
+    static constexpr bool has_parent = true;
+};
+
+struct compact_layout {
+    using node_base = compact_node_base;
+    static constexpr bool has_parent = false;
+};
+
+// where the iterators of a compact map find it; the cell goes with the
+// nodes on move and swap, so iterators stay valid across both
+template <typename Owner>
+struct owner_home {
+    Owner const* owner;
+};
+
+template <typename Owner, bool Stored>
+struct home_slot {};
+
+template <typename Owner>
+struct home_slot<Owner, true> {
+    owner_home<Owner>* home{nullptr};
+};
+
+template <typename Owner, bool Stored>
+struct owner_ref {
+    owner_ref() = default;
+    owner_ref(owner_home<Owner> const*) noexcept {}
+
+    owner_home<Owner> const* get_home() const noexcept {
+        return nullptr;
+    }
+};
+
+template <typename Owner>
+struct owner_ref<Owner, true> {
+    owner_ref() = default;
+    owner_ref(owner_home<Owner> const* home_) noexcept : home(home_) {}
+
+    owner_home<Owner> const* get_home() const noexcept {
+        return home;
+    }
+
+    Owner const* get_owner() const noexcept {
+        return home->owner;
+    }
+
+  private:
+    owner_home<Owner> const* home{nullptr};
+};
+
+template <typename T, typename Tag, typename Policy>
+struct tree_node : Policy::layout::node_base,
+                   Policy::priority::node_data,
+                   Policy::augmentation::node_data {
     T value;
 
     tree_node() = default;
     tree_node(const T& value_) : value(value_) {}
     tree_node(T&& value_) noexcept : value(std::move(value_)) {}
+
+    template <typename Tuple>
+    tree_node(std::piecewise_construct_t, Tuple&& args)
+        : value(std::make_from_tuple<T>(std::forward<Tuple>(args))) {}
     ~tree_node() = default;
 };
 
-template <typename T, typename Tag>
-node_base& to_base(tree_node<T, Tag>& x) {
-    return static_cast<node_base&>(x);
+template <typename Policy>
+using node_base_t = typename Policy::layout::node_base;
+
+template <typename T, typename Tag, typename Policy>
+node_base_t<Policy>& to_base(tree_node<T, Tag, Policy>& x) {
+    return static_cast<node_base_t<Policy>&>(x);
 }
 
-template <typename T, typename Tag>
-tree_node<T, Tag>& base_to_tree_node(node_base& x) {
-    return static_cast<tree_node<T, Tag>&>(x);
+template <typename T, typename Tag, typename Policy>
+tree_node<T, Tag, Policy>& base_to_tree_node(node_base_t<Policy>& x) {
+    return static_cast<tree_node<T, Tag, Policy>&>(x);
 }
 
-template <typename T, typename Tag>
-T& get_value(node_base* x) {
-    return base_to_tree_node<T, Tag>(*x).value;
+template <typename T, typename Tag, typename Policy>
+T& get_value(node_base_t<Policy>* x) {
+    return base_to_tree_node<T, Tag, Policy>(*x).value;
 }
 
-template <typename T, typename Comparator,
-          typename Tag>
-struct tree : Comparator {
+template <typename T, typename Comparator, typename Tag, typename Policy>
+struct tree : Comparator, Policy::statistics::tree_counters {
 
     using cmp_t = Comparator;
-    using node_t = tree_node<T, Tag>;
+    using node_t = tree_node<T, Tag, Policy>;
+    using priority_t = typename Policy::priority;
+    using base_t = node_base_t<Policy>;
+    using counters_t = typename Policy::statistics::tree_counters;
+
+    static constexpr bool has_parent = Policy::layout::has_parent;
+    static constexpr bool sized = Policy::augmentation::enabled;
+    static constexpr bool counted = Policy::statistics::enabled;
 
     tree(cmp_t&& cmp_) noexcept : Comparator(std::move(cmp_)) {};
     tree(const cmp_t& cmp_) : Comparator(cmp_) {};
@@ -96,73 +355,532 @@ struct tree : Comparator {
     tree(const tree&) = delete;
     tree& operator=(tree const&) = delete;
     tree(tree&& other) noexcept : Comparator(std::move(other.cmp())),
-          sentinel(std::move(other.sentinel)) {
-        if (sentinel.left != nullptr) {
-            sentinel.left->parent = &sentinel;
-        }
+          sentinel(std::move(other.sentinel)),
+          tail(std::exchange(other.tail, nullptr)) {
+        link_parent(sentinel.left, &sentinel);
+        other.sentinel.left = nullptr;
     }
 
     void swap(tree& other) {
-        swap_sentinel(sentinel, other.sentinel);
+        if constexpr (has_parent) {
+            swap_sentinel(sentinel, other.sentinel);
+        } else {
+            std::swap(sentinel.left, other.sentinel.left);
+            std::swap(sentinel.right, other.sentinel.right);
+        }
+        std::swap(tail, other.tail);
         std::swap(cmp(), other.cmp());
     }
 
-    node_base* root() const noexcept {
+    base_t* root() const noexcept {
         return sentinel.left;
     }
 
-    node_base* insert(node_t* new_node) noexcept {
-        if (root() == nullptr) {
-            set_root(&to_base<T, Tag>(*new_node));
-            return new_node;
+    // one descent both looks for an equal key and finds the slot the new
+    // node goes to; on a duplicate the tree is left untouched and the equal
+    // node is returned
+    std::pair<base_t*, bool> insert(node_t* new_node) noexcept {
+        base_t* v = &to_base<T, Tag, Policy>(*new_node);
+        T const& value = new_node->value;
+        base_t* parent = get_sentinel();
+        base_t** slot = &parent->left;
+        base_t* insert_parent = nullptr;
+        base_t** insert_slot = nullptr;
+        base_t* candidate = nullptr;
+        while (*slot != nullptr) {
+            base_t* u = *slot;
+            if (insert_slot == nullptr) {
+                if (priority(u) < priority(v)) {
+                    insert_parent = parent;
+                    insert_slot = slot;
+                } else if constexpr (sized) {
+                    size_ref(u)++;
+                }
+            }
+            bool go_left;
+            if constexpr (three_way<T>) {
+                int order = compare(value, value_of(u));
+                if (order == 0) {
+                    candidate = u;
+                    break;
+                }
+                go_left = (order < 0);
+            } else {
+                go_left = less_or_equal(value, value_of(u));
+                if (go_left) {
+                    candidate = u;
+                }
+            }
+            parent = u;
+            slot = (go_left ? &u->left : &u->right);
+        }
+        if (candidate != nullptr && !less(value, value_of(candidate))) {
+            if constexpr (sized) {
+                undo_insert_sizes(v, candidate);
+            }
+            return {candidate, false};
+        }
+        if (insert_slot == nullptr) {
+            insert_parent = parent;
+            insert_slot = slot;
+        }
+        link_at(v, insert_parent, insert_slot);
+        return {v, true};
+    }
+
+    // where a descent for value ends: the equal node if there is one, and
+    // the turns taken otherwise, so that a node made afterwards can be
+    // linked without comparing keys again
+    struct descent {
+        base_t* found{nullptr};
+        uint64_t turns{0};
+        std::size_t depth{0};
+    };
+
+    descent locate(const T& value) const noexcept {
+        descent result;
+        base_t* candidate = nullptr;
+        base_t* u = root();
+        while (u != nullptr) {
+            bool go_left;
+            if constexpr (three_way<T>) {
+                int order = compare(value, value_of(u));
+                if (order == 0) {
+                    result.found = u;
+                    return result;
+                }
+                go_left = (order < 0);
+            } else {
+                go_left = less_or_equal(value, value_of(u));
+                if (go_left) {
+                    candidate = u;
+                }
+            }
+            if (!go_left && result.depth < max_turns) {
+                result.turns |= uint64_t(1) << result.depth;
+            }
+            result.depth++;
+            u = (go_left ? u->left : u->right);
+        }
+        if (candidate != nullptr && !less(value, value_of(candidate))) {
+            result.found = candidate;
+        }
+        return result;
+    }
+
+    // links a node whose key locate found absent; the tree must not have
+    // changed since. Paths too deep for the turns are searched again
+    base_t* insert(node_t* new_node, descent const& path) noexcept {
+        if (path.depth > max_turns) {
+            return insert(new_node).first;
         }
-        std::pair<node_base*, node_base*> splited =
-            split(root(), get_value<T, Tag>(new_node), true);
-        splited.second = merge(new_node, splited.second);
-        set_root(merge(splited.first, splited.second));
-        return new_node;
+        base_t* v = &to_base<T, Tag, Policy>(*new_node);
+        base_t* parent = get_sentinel();
+        base_t** slot = &parent->left;
+        for (std::size_t i = 0;
+             *slot != nullptr && priority(*slot) >= priority(v); i++) {
+            if constexpr (sized) {
+                size_ref(*slot)++;
+            }
+            parent = *slot;
+            slot = ((path.turns >> i) & 1 ? &parent->right : &parent->left);
+        }
+        link_at(v, parent, slot);
+        return v;
+    }
+
+    // links new_node between prev and next, which must be its neighbours
+    // (prev is nullptr at the front); walks up by rotations, so only the
+    // parent layout supports it
+    base_t* insert_before(base_t* next, base_t* prev,
+                          node_t* new_node) noexcept {
+        static_assert(has_parent, "insert_before needs parent pointers");
+        base_t* v = &to_base<T, Tag, Policy>(*new_node);
+        v->left = nullptr;
+        v->right = nullptr;
+        if (next->left == nullptr) {
+            next->left = v;
+            set_parent(v, next);
+        } else {
+            prev->right = v;
+            set_parent(v, prev);
+        }
+        if (next == end()) {
+            tail = v;
+        }
+        if constexpr (sized) {
+            size_ref(v) = 1;
+            for (base_t* u = v->parent; u->parent != nullptr; u = u->parent) {
+                size_ref(u)++;
+            }
+        }
+        std::size_t rotations = 0;
+        while (v->parent->parent != nullptr &&
+               priority(v->parent) < priority(v)) {
+            rotate_up(v);
+            rotations++;
+        }
+        record([rotations](auto const& c) {
+            c.rotations.add(rotations);
+        });
+        return v;
+    }
+
+    // the nodes a new key goes between when hint is one of them, prev
+    // being nullptr at the front; next is nullptr if hint is not next to
+    // the key or the key is already there. hint_steps counts the links
+    // walked, so an append at the cached tail takes none
+    template <typename K>
+    std::pair<base_t*, base_t*> neighbours(base_t* hint,
+                                           const K& key) noexcept {
+        static_assert(has_parent, "neighbours needs parent pointers");
+        std::size_t steps = 0;
+        base_t* prev = nullptr;
+        base_t* next = nullptr;
+        if (hint != end() && less(value_of(hint), key)) {
+            prev = hint;
+            next = (hint == tail ? end() : walk(hint, true, steps));
+            if (next != end() && !less(key, value_of(next))) {
+                next = nullptr;
+            }
+        } else if (hint == end() || less(key, value_of(hint))) {
+            next = hint;
+            prev = (hint == end() ? last(steps) : walk(hint, false, steps));
+            if (prev != nullptr && !less(value_of(prev), key)) {
+                next = nullptr;
+            }
+        }
+        record([steps](auto const& c) { c.hint_steps.add(steps); });
+        return {prev, next};
+    }
+
+    template <typename K>
+    base_t* find(const K& value) const noexcept {
+        base_t* v = root();
+        std::size_t steps = 0;
+        base_t* found = end();
+        if constexpr (three_way<K>) {
+            while (v != nullptr) {
+                steps++;
+                int order = compare(value, value_of(v));
+                if (order < 0) {
+                    v = v->left;
+                } else if (order > 0) {
+                    v = v->right;
+                } else {
+                    found = v;
+                    break;
+                }
+            }
+        } else {
+            base_t* candidate = search(value, true, steps);
+            if (candidate != end()) {
+                steps++;
+                if (!less(value, value_of(candidate))) {
+                    found = candidate;
+                }
+            }
+        }
+        record([steps](auto const& c) {
+            c.finds.add();
+            c.find_comparisons.add(steps);
+        });
+        return found;
+    }
+
+    template <typename Deleter>
+    void clear(Deleter&& deleter) noexcept {
+        dispose(root(), deleter);
+        set_root(nullptr);
+    }
+
+    // detaches the nodes of [first, last) as a treap of their own
+    base_t* cut(base_t* first, base_t* last) noexcept {
+        auto [before, range] = split(root(), value_of(first), true);
+        base_t* after = nullptr;
+        if (last != end()) {
+            std::tie(range, after) = split(range, value_of(last), true);
+        }
+        set_root(merge(before, after));
+        return range;
+    }
+
+    // detaches the nodes not less than value as a treap of their own
+    template <typename K>
+    base_t* split_off(const K& value) noexcept {
+        auto [kept, rest] = split(root(), value, true);
+        set_root(kept);
+        return rest;
+    }
+
+    // undoes split_off
+    void rejoin(base_t* rest) noexcept {
+        set_root(merge(root(), rest));
+    }
+
+    // hands every node of a detached treap to deleter, flattening it by
+    // rotations instead of a stack
+    template <typename Deleter>
+    static void dispose(base_t* v, Deleter&& deleter) noexcept {
+        while (v != nullptr) {
+            if (v->left != nullptr) {
+                base_t* left = v->left;
+                v->left = left->right;
+                left->right = v;
+                v = left;
+            } else {
+                base_t* next = v->right;
+                deleter(v);
+                v = next;
+            }
+        }
+    }
+
+    template <typename NodeIt>
+    void build(NodeIt first, NodeIt last) noexcept {
+        set_root(make_treap(first, last));
+    }
+
+    // the halves are built on their own threads and merged
+    template <typename NodeIt>
+    void build_parallel(NodeIt first, NodeIt last, unsigned threads) {
+        set_root(make_treap_parallel(first, last, threads));
+    }
+
+    // adds the nodes of a detached treap; reject gets every one of them
+    // whose key is already present, those are left out of the tree
+    template <typename Reject>
+    void unite(base_t* other, Reject&& reject) {
+        set_root(unite(root(), other, reject, 1, 0));
     }
 
-    node_base* find(const T& value) const noexcept {
-        return find(root(), value);
+    // size is the node count of both treaps. The two halves of a level run
+    // concurrently until they fall below parallel_cutoff, so reject has to
+    // be thread safe
+    template <typename Reject>
+    void unite_parallel(base_t* other, std::size_t size, Reject&& reject,
+                        unsigned threads) {
+        set_root(unite(root(), other, reject, threads, size));
     }
 
-    node_base* const begin() const noexcept {
-        return get_leftmost(get_sentinel());
+    // removes the nodes with the given sorted keys and hands them to erased
+    template <typename KeyIt, typename Erased>
+    void subtract(KeyIt first, KeyIt last, Erased&& erased) noexcept {
+        set_root(subtract(root(), first, last, erased));
     }
 
-    node_base* const end() const noexcept {
+    base_t* const begin() const noexcept {
+        return leftmost(get_sentinel());
+    }
+
+    base_t* const end() const noexcept {
         return get_sentinel();
     }
 
-    node_base* lower_bound(const T& value) const noexcept {
-        node_base* found = search(root(), value, true);
-        if (equal(get_value<T, Tag>(found), value)) {
-            return found;
-        } else if (less(get_value<T, Tag>(found), value)) {
-            return get_next(found);
+    template <typename K>
+    base_t* lower_bound(const K& value) const noexcept {
+        return counted_search(value, true);
+    }
+
+    template <typename K>
+    base_t* upper_bound(const K& value) const noexcept {
+        return counted_search(value, false);
+    }
+
+    base_t* next(base_t* v) const noexcept {
+        if constexpr (has_parent) {
+            return get_next(v);
         } else {
-            return found;
+            return counted_search(value_of(v), false);
         }
     }
 
-    node_base* upper_bound(const T& value) const noexcept {
-        node_base* found = search(root(), value, false);
-        if (equal(get_value<T, Tag>(found), value)) {
-            return get_next(found);
-        } else if (less(get_value<T, Tag>(found), value)) {
-            return get_next(found);
+    base_t* prev(base_t* v) const noexcept {
+        if constexpr (has_parent) {
+            return get_prev(v);
         } else {
+            if (v == end()) {
+                return rightmost(root());
+            }
+            base_t* found = nullptr;
+            base_t* u = root();
+            while (u != nullptr) {
+                if (less(value_of(u), value_of(v))) {
+                    found = u;
+                    u = u->right;
+                } else {
+                    u = u->left;
+                }
+            }
             return found;
         }
     }
 
+    base_t* nth(std::size_t k) const noexcept {
+        return select(get_sentinel(), k);
+    }
+
+    // number of elements less than value
+    template <typename K>
+    std::size_t rank(const K& value) const noexcept {
+        std::size_t result = 0;
+        base_t* v = root();
+        while (v != nullptr) {
+            if (less_or_equal(value, value_of(v))) {
+                v = v->left;
+            } else {
+                result += subtree_size(v->left) + 1;
+                v = v->right;
+            }
+        }
+        return result;
+    }
+
+    std::size_t index_of(base_t* v) const noexcept {
+        if constexpr (has_parent) {
+            return climb(v).first;
+        } else {
+            return (v == end() ? subtree_size(root()) : rank(value_of(v)));
+        }
+    }
+
+    static base_t* select(base_t* sentinel, std::size_t k) noexcept {
+        base_t* v = sentinel->left;
+        while (v != nullptr) {
+            std::size_t left_size = subtree_size(v->left);
+            if (k < left_size) {
+                v = v->left;
+            } else if (k == left_size) {
+                return v;
+            } else {
+                k -= left_size + 1;
+                v = v->right;
+            }
+        }
+        return sentinel;
+    }
+
+    // index of v and the sentinel of its tree, found by walking up
+    static std::pair<std::size_t, base_t*> climb(base_t* v) noexcept {
+        if (v->parent == nullptr) {
+            return {subtree_size(v->left), v};
+        }
+        std::size_t index = subtree_size(v->left);
+        while (v->parent->parent != nullptr) {
+            if (v->parent->right == v) {
+                index += subtree_size(v->parent->left) + 1;
+            }
+            v = v->parent;
+        }
+        return {index, v->parent};
+    }
+
+    // the counters so far and the depths of the current shape, the root
+    // being at depth 1; walks the whole tree
+    tree_stats stats() const {
+        static_assert(counted, "the policy keeps no statistics");
+        counters_t const& c = *this;
+        tree_stats result{c.finds.load(),
+                          c.find_comparisons.load(),
+                          c.searches.load(),
+                          c.search_comparisons.load(),
+                          c.splits.load(),
+                          c.split_comparisons.load(),
+                          c.merges.load(),
+                          c.rotations.load(),
+                          c.hint_steps.load(),
+                          0,
+                          0};
+        std::size_t nodes = 0;
+        std::size_t total_depth = 0;
+        std::vector<std::pair<base_t*, std::size_t>> stack;
+        if (root() != nullptr) {
+            stack.emplace_back(root(), 1);
+        }
+        while (!stack.empty()) {
+            auto [v, depth] = stack.back();
+            stack.pop_back();
+            nodes++;
+            total_depth += depth;
+            result.max_depth = std::max(result.max_depth, depth);
+            if (v->left != nullptr) {
+                stack.emplace_back(v->left, depth + 1);
+            }
+            if (v->right != nullptr) {
+                stack.emplace_back(v->right, depth + 1);
+            }
+        }
+        if (nodes != 0) {
+            result.average_depth = static_cast<double>(total_depth) / nodes;
+        }
+        return result;
+    }
+
+    // one in-order walk; the stack holds a path, so it stays O(depth)
+    tree_shape analyze() const {
+        tree_shape result;
+        if constexpr (has_parent) {
+            result.parents_linked = sentinel.parent == nullptr &&
+                                    (root() == nullptr ||
+                                     root()->parent == get_sentinel());
+        }
+        std::vector<std::pair<base_t*, std::size_t>> stack;
+        base_t* previous = nullptr;
+        auto push_left_spine = [&stack](base_t* v, std::size_t depth) {
+            for (; v != nullptr; v = v->left) {
+                stack.emplace_back(v, depth++);
+            }
+        };
+        push_left_spine(root(), 1);
+        while (!stack.empty()) {
+            auto [v, depth] = stack.back();
+            stack.pop_back();
+            result.nodes++;
+            if (result.depths.size() < depth) {
+                result.depths.resize(depth);
+                result.leaf_depths.resize(depth);
+            }
+            result.depths[depth - 1]++;
+            if (v->left == nullptr && v->right == nullptr) {
+                result.leaf_depths[depth - 1]++;
+            }
+            if (previous != nullptr &&
+                !less(value_of(previous), value_of(v))) {
+                result.ordered = false;
+            }
+            previous = v;
+            for (base_t* child : {v->left, v->right}) {
+                if (child == nullptr) {
+                    continue;
+                }
+                if (priority(child) > priority(v)) {
+                    result.heap_ordered = false;
+                }
+                if constexpr (has_parent) {
+                    if (child->parent != v) {
+                        result.parents_linked = false;
+                    }
+                }
+            }
+            if constexpr (sized) {
+                if (size_ref(v) !=
+                    subtree_size(v->left) + subtree_size(v->right) + 1) {
+                    result.sizes_consistent = false;
+                }
+            }
+            push_left_spine(v->right, depth + 1);
+        }
+        return result;
+    }
+
     template <typename Left, typename Right, typename CompareLeft,
-              typename CompareRight>
+              typename CompareRight, typename Allocator,
+              typename BimapPolicy>
     friend struct ::bimap;
 
   private:
-    node_base sentinel;
+    base_t sentinel;
+    base_t* tail{nullptr};
 
     cmp_t& cmp() noexcept {
         return static_cast<cmp_t&>(*this);
@@ -172,133 +890,492 @@ struct tree : Comparator {
         return static_cast<cmp_t const&>(*this);
     }
 
-    bool greater_or_equal(const T& x, const T& y) const noexcept {
-        return !cmp()(x, y);
+    static uint32_t priority(base_t* v) noexcept {
+        return priority_t::get(base_to_tree_node<T, Tag, Policy>(*v));
     }
 
-    bool less_or_equal(const T& x, const T& y) const noexcept {
-        return greater_or_equal(y, x);
+    static T const& value_of(base_t* v) noexcept {
+        return get_value<T, Tag, Policy>(v);
     }
 
-    bool less(const T& x, const T& y) const noexcept {
-        return cmp()(x, y);
+    static std::size_t& size_ref(base_t* v) noexcept {
+        return base_to_tree_node<T, Tag, Policy>(*v).size;
     }
 
-    bool greater(const T& x, const T& y) const noexcept {
-        return less(y, x);
+    static std::size_t subtree_size(base_t* v) noexcept {
+        return (v == nullptr ? 0 : size_ref(v));
     }
 
-    bool equal(const T& x, const T& y) const noexcept {
-        return less_or_equal(x, y) && less_or_equal(y, x);
+    static void resize(base_t* v) noexcept {
+        if constexpr (sized) {
+            size_ref(v) = 1 + subtree_size(v->left) + subtree_size(v->right);
+        }
     }
 
-    std::pair<node_base*, node_base*> split(node_base* v, const T& value,
-                                            bool inclusive) noexcept {
-        if (v == nullptr) {
-            return {nullptr, nullptr};
-        }
-        bool go_left = (inclusive ? less_or_equal(value, get_value<T, Tag>(v))
-                                  : less(value, get_value<T, Tag>(v)));
-        if (go_left) {
-            std::pair<node_base*, node_base*> splited =
-                split(v->left, value, inclusive);
-
-            v->left = splited.second;
-            set_parent(splited.second, v);
-            return {splited.first, v};
+    // the children off the spine are untouched subtrees
+    static void resize_spine(base_t* v, bool right_spine) noexcept {
+        std::size_t total = 0;
+        for (base_t* u = v; u != nullptr;
+             u = (right_spine ? u->right : u->left)) {
+            total += 1 + subtree_size(right_spine ? u->left : u->right);
+        }
+        for (base_t* u = v; u != nullptr;
+             u = (right_spine ? u->right : u->left)) {
+            size_ref(u) = total;
+            total -= 1 + subtree_size(right_spine ? u->left : u->right);
+        }
+    }
+
+    static constexpr std::size_t max_turns = 64;
+
+    // v takes the place of the subtree in slot, which is split around it
+    void link_at(base_t* v, base_t* parent, base_t** slot) noexcept {
+        std::pair<base_t*, base_t*> splited =
+            split(*slot, value_of(v), true);
+        v->left = splited.first;
+        link_parent(splited.first, v);
+        v->right = splited.second;
+        link_parent(splited.second, v);
+        resize(v);
+        *slot = v;
+        link_parent(v, parent);
+        tail = nullptr;
+    }
+
+    // retraces the descent of a rejected insert of v
+    void undo_insert_sizes(base_t* v, base_t* duplicate) noexcept {
+        base_t* u = root();
+        while (u != nullptr && priority(u) >= priority(v)) {
+            size_ref(u)--;
+            if (three_way<T> && u == duplicate) {
+                break;
+            }
+            u = (less_or_equal(value_of(v), value_of(u)) ? u->left : u->right);
+        }
+    }
+
+    static void rotate_up(base_t* v) noexcept {
+        base_t* p = v->parent;
+        base_t* g = p->parent;
+        if (p->left == v) {
+            p->left = v->right;
+            link_parent(v->right, p);
+            v->right = p;
         } else {
-            std::pair<node_base*, node_base*> splited =
-                split(v->right, value, inclusive);
+            p->right = v->left;
+            link_parent(v->left, p);
+            v->left = p;
+        }
+        if constexpr (sized) {
+            size_ref(v) = size_ref(p);
+            resize(p);
+        }
+        if (g->left == p) {
+            g->left = v;
+        } else {
+            g->right = v;
+        }
+        set_parent(p, v);
+        set_parent(v, g);
+    }
+
+    static void link_parent(base_t* v, base_t* parent) noexcept {
+        if constexpr (has_parent) {
+            set_parent(v, parent);
+        }
+    }
 
-            v->right = splited.first;
-            set_parent(splited.first, v);
-            return {v, splited.second};
+    // the greatest node, nullptr if the tree is empty. Appends keep it
+    // cached, anything else that adds or removes nodes drops the cache
+    base_t* last(std::size_t& steps) noexcept {
+        if (tail == nullptr) {
+            tail = root();
+            while (tail != nullptr && tail->right != nullptr) {
+                tail = tail->right;
+                steps++;
+            }
         }
+        return tail;
     }
 
-    node_base* merge(node_base* left, node_base* right) noexcept {
-        if (left == nullptr && right == nullptr) {
-            return nullptr;
+    // get_next or get_prev, counting the links followed
+    static base_t* walk(base_t* v, bool forward,
+                        std::size_t& steps) noexcept {
+        base_t* down = (forward ? v->right : v->left);
+        if (down != nullptr) {
+            steps++;
+            while ((forward ? down->left : down->right) != nullptr) {
+                down = (forward ? down->left : down->right);
+                steps++;
+            }
+            return down;
         }
-        if (left == nullptr) {
-            return right;
+        while (v->parent != nullptr &&
+               (forward ? v->parent->right : v->parent->left) == v) {
+            v = v->parent;
+            steps++;
         }
-        if (right == nullptr) {
-            return left;
+        steps++;
+        return v->parent;
+    }
+
+    static base_t* leftmost(base_t* v) noexcept {
+        while (v != nullptr && v->left != nullptr) {
+            v = v->left;
         }
-        if (left->priority >= right->priority) {
-            node_base* merged = merge(left->right, right);
-            left->right = merged;
-            set_parent(merged, left);
-            return left;
+        return v;
+    }
+
+    static base_t* rightmost(base_t* v) noexcept {
+        while (v != nullptr && v->right != nullptr) {
+            v = v->right;
+        }
+        return v;
+    }
+
+    static constexpr bool ordering_cmp =
+        is_ordering_comparator<cmp_t, T>::value;
+
+    template <typename K>
+    static constexpr bool member_compare =
+        standard_order<cmp_t>::value != 0 && is_standard_string<T>::value &&
+        has_compare_member<T, K>::value;
+
+    template <typename K>
+    static constexpr bool three_way = ordering_cmp || member_compare<K>;
+
+    template <typename K>
+    int compare(const K& key, const T& value) const noexcept {
+        if constexpr (ordering_cmp) {
+            auto result = cmp()(key, value);
+            return (result < 0 ? -1 : (result == 0 ? 0 : 1));
+        } else if constexpr (member_compare<K>) {
+            int result = value.compare(key);
+            return (result < 0 ? 1 : (result == 0 ? 0 : -1)) *
+                   standard_order<cmp_t>::value;
         } else {
-            node_base* merged = merge(left, right->left);
-            right->left = merged;
-            set_parent(merged, right);
-            return right;
+            return (less(key, value) ? -1 : (less(value, key) ? 1 : 0));
         }
     }
 
-    node_base* find(node_base* v, const T& value) const noexcept {
-        if (v == nullptr) {
-            return end();
+    template <typename X, typename Y>
+    bool greater_or_equal(const X& x, const Y& y) const noexcept {
+        return !less(x, y);
+    }
+
+    template <typename X, typename Y>
+    bool less_or_equal(const X& x, const Y& y) const noexcept {
+        return greater_or_equal(y, x);
+    }
+
+    template <typename X, typename Y>
+    bool less(const X& x, const Y& y) const noexcept {
+        if constexpr (ordering_cmp) {
+            return cmp()(x, y) < 0;
+        } else {
+            return cmp()(x, y);
         }
-        if (less(value, get_value<T, Tag>(v))) {
-            return find(v->left, value);
-        } else if (greater(value, get_value<T, Tag>(v))) {
-            return find(v->right, value);
+    }
+
+    template <typename X, typename Y>
+    bool greater(const X& x, const Y& y) const noexcept {
+        return less(y, x);
+    }
+
+    bool equal(const T& x, const T& y) const noexcept {
+        if constexpr (three_way<T>) {
+            return compare(x, y) == 0;
         } else {
-            return v;
+            return less_or_equal(x, y) && less_or_equal(y, x);
         }
     }
 
-    node_base* search(node_base* v, const T& value,
-                      bool inclusive) const noexcept {
-        if (v == nullptr) {
-            return nullptr;
-        } else if (equal(value, get_value<T, Tag>(v))) {
-            return v;
-        } else if ((inclusive && less_or_equal(value, get_value<T, Tag>(v))) ||
-                   ((!inclusive && less(value, get_value<T, Tag>(v))))) {
-            node_base* found = search(v->left, value, inclusive);
-            if (found == nullptr) {
-                return v;
+    std::pair<base_t*, base_t*> split(base_t* v, const T& value,
+                                            bool inclusive) noexcept {
+        base_t* left_root = nullptr;
+        base_t* right_root = nullptr;
+        base_t** left_slot = &left_root;
+        base_t** right_slot = &right_root;
+        base_t* left_parent = nullptr;
+        base_t* right_parent = nullptr;
+        std::size_t steps = 0;
+        while (v != nullptr) {
+            steps++;
+            bool go_left =
+                (inclusive ? less_or_equal(value, value_of(v))
+                           : less(value, value_of(v)));
+            if (go_left) {
+                *right_slot = v;
+                link_parent(v, right_parent);
+                right_parent = v;
+                right_slot = &v->left;
+                v = v->left;
+            } else {
+                *left_slot = v;
+                link_parent(v, left_parent);
+                left_parent = v;
+                left_slot = &v->right;
+                v = v->right;
+            }
+        }
+        *left_slot = nullptr;
+        *right_slot = nullptr;
+        if constexpr (sized) {
+            resize_spine(left_root, true);
+            resize_spine(right_root, false);
+        }
+        record([steps](auto const& c) {
+            c.splits.add();
+            c.split_comparisons.add(steps);
+        });
+        return {left_root, right_root};
+    }
+
+    base_t* merge(base_t* left, base_t* right) noexcept {
+        record([](auto const& c) { c.merges.add(); });
+        base_t* result = nullptr;
+        base_t** slot = &result;
+        base_t* parent = nullptr;
+        while (left != nullptr && right != nullptr) {
+            if (priority(left) >= priority(right)) {
+                if constexpr (sized) {
+                    size_ref(left) += subtree_size(right);
+                }
+                *slot = left;
+                link_parent(left, parent);
+                parent = left;
+                slot = &left->right;
+                left = left->right;
+            } else {
+                if constexpr (sized) {
+                    size_ref(right) += subtree_size(left);
+                }
+                *slot = right;
+                link_parent(right, parent);
+                parent = right;
+                slot = &right->left;
+                right = right->left;
+            }
+        }
+        base_t* rest = (left != nullptr ? left : right);
+        *slot = rest;
+        link_parent(rest, parent);
+        return result;
+    }
+
+    template <typename K>
+    base_t* search(const K& value, bool inclusive,
+                   std::size_t& steps) const noexcept {
+        base_t* found = end();
+        base_t* v = root();
+        while (v != nullptr) {
+            steps++;
+            bool go_left =
+                (inclusive ? less_or_equal(value, value_of(v))
+                           : less(value, value_of(v)));
+            if (go_left) {
+                found = v;
+                v = v->left;
+            } else {
+                v = v->right;
+            }
+        }
+        return found;
+    }
+
+    template <typename K>
+    base_t* counted_search(const K& value, bool inclusive) const noexcept {
+        std::size_t steps = 0;
+        base_t* found = search(value, inclusive, steps);
+        record([steps](auto const& c) {
+            c.searches.add();
+            c.search_comparisons.add(steps);
+        });
+        return found;
+    }
+
+    // compiled out unless the policy keeps statistics
+    template <typename F>
+    void record(F&& f) const noexcept {
+        if constexpr (counted) {
+            f(static_cast<counters_t const&>(*this));
+        }
+    }
+
+    void erase_helper(base_t* v) noexcept {
+        tail = nullptr;
+        base_t* left = v->left;
+        base_t* right = v->right;
+        base_t* new_son = merge(left, right);
+        if constexpr (has_parent) {
+            link_parent(new_son, v->parent);
+            if (is_left_son(v->parent, v)) {
+                v->parent->left = new_son;
+            } else if (is_right_son(v->parent, v)) {
+                v->parent->right = new_son;
+            }
+            if constexpr (sized) {
+                for (base_t* u = v->parent; u->parent != nullptr;
+                     u = u->parent) {
+                    size_ref(u)--;
+                }
             }
-            return found;
         } else {
-            node_base* found = search(v->right, value, inclusive);
-            if (found == nullptr) {
-                return v;
+            base_t** slot = &sentinel.left;
+            while (*slot != v) {
+                if constexpr (sized) {
+                    size_ref(*slot)--;
+                }
+                slot = less(value_of(v), value_of(*slot)) ? &(*slot)->left
+                                                          : &(*slot)->right;
             }
-            return found;
+            *slot = new_son;
         }
     }
 
-    void erase_helper(node_base* v) noexcept {
-        node_base* left = v->left;
-        node_base* right = v->right;
-        node_base* new_son = merge(left, right);
-        if (new_son != nullptr) {
-            new_son->parent = v->parent;
+    // the range is reused as the stack of the right spine
+    template <typename NodeIt>
+    static base_t* make_treap(NodeIt first, NodeIt last) noexcept {
+        NodeIt spine_end = first;
+        for (NodeIt it = first; it != last; ++it) {
+            base_t* v = *it;
+            base_t* child = nullptr;
+            while (spine_end != first &&
+                   priority(*std::prev(spine_end)) < priority(v)) {
+                child = *--spine_end;
+                resize(child);
+            }
+            v->left = child;
+            v->right = nullptr;
+            link_parent(child, v);
+            if (spine_end != first) {
+                (*std::prev(spine_end))->right = v;
+                link_parent(v, *std::prev(spine_end));
+            }
+            *spine_end++ = v;
         }
-        if (is_left_son(v->parent, v)) {
-            v->parent->left = new_son;
-        } else if (is_right_son(v->parent, v)) {
-            v->parent->right = new_son;
+        while (spine_end != first) {
+            resize(*--spine_end);
         }
+        return (first != last ? *first : nullptr);
+    }
+
+    template <typename NodeIt>
+    base_t* make_treap_parallel(NodeIt first, NodeIt last, unsigned threads) {
+        if (threads < 2 ||
+            static_cast<std::size_t>(last - first) < parallel_cutoff) {
+            return make_treap(first, last);
+        }
+        NodeIt mid = first + (last - first) / 2;
+        base_t* left = nullptr;
+        base_t* right = nullptr;
+        fork_join(
+            threads,
+            [&] { left = make_treap_parallel(first, mid, threads / 2); },
+            [&] {
+                right = make_treap_parallel(mid, last, threads - threads / 2);
+            });
+        return merge(left, right);
+    }
+
+    // size counts the nodes of a and b; without subtree sizes it is
+    // estimated as half of the level above
+    template <typename Reject>
+    base_t* unite(base_t* a, base_t* b, Reject& reject, unsigned threads,
+                  std::size_t size) {
+        if (a == nullptr) {
+            return b;
+        }
+        if (b == nullptr) {
+            return a;
+        }
+        if constexpr (sized) {
+            size = subtree_size(a) + subtree_size(b);
+        }
+        if (size < parallel_cutoff) {
+            threads = 1;
+        }
+        size /= 2;
+        base_t* left = nullptr;
+        base_t* right = nullptr;
+        if (priority(a) >= priority(b)) {
+            auto [less_part, rest] = split(b, value_of(a), true);
+            auto [equal_part, greater_part] = split(rest, value_of(a), false);
+            if (equal_part != nullptr) {
+                reject(equal_part);
+            }
+            base_t* a_left = a->left;
+            base_t* a_right = a->right;
+            fork_join(
+                threads,
+                [&, less_part = less_part] {
+                    left = unite(a_left, less_part, reject, threads / 2,
+                                 size);
+                },
+                [&, greater_part = greater_part] {
+                    right = unite(a_right, greater_part, reject,
+                                  threads - threads / 2, size);
+                });
+            set_children(a, left, right);
+            return a;
+        }
+        auto [less_part, rest] = split(a, value_of(b), true);
+        auto [equal_part, greater_part] = split(rest, value_of(b), false);
+        base_t* b_left = b->left;
+        base_t* b_right = b->right;
+        fork_join(
+            threads,
+            [&, less_part = less_part] {
+                left = unite(less_part, b_left, reject, threads / 2, size);
+            },
+            [&, greater_part = greater_part] {
+                right = unite(greater_part, b_right, reject,
+                              threads - threads / 2, size);
+            });
+        if (equal_part == nullptr) {
+            set_children(b, left, right);
+            return b;
+        }
+        reject(b);
+        return merge(merge(left, equal_part), right);
+    }
+
+    template <typename KeyIt, typename Erased>
+    base_t* subtract(base_t* v, KeyIt first, KeyIt last,
+                     Erased& erased) noexcept {
+        if (v == nullptr || first == last) {
+            return v;
+        }
+        KeyIt mid = first + (last - first) / 2;
+        auto [less_part, rest] = split(v, *mid, true);
+        auto [equal_part, greater_part] = split(rest, *mid, false);
+        if (equal_part != nullptr) {
+            erased(equal_part);
+        }
+        return merge(subtract(less_part, first, mid, erased),
+                     subtract(greater_part, std::next(mid), last, erased));
+    }
+
+    static void set_children(base_t* v, base_t* left, base_t* right) noexcept {
+        v->left = left;
+        link_parent(left, v);
+        v->right = right;
+        link_parent(right, v);
+        resize(v);
     }
 
-    void set_another_tree_pointer(node_base* other_tree_sentinel) noexcept {
+    void set_another_tree_pointer(base_t* other_tree_sentinel) noexcept {
         sentinel.right = other_tree_sentinel;
     }
 
-    node_base* get_sentinel() const noexcept {
-        return const_cast<node_base*>(&sentinel);
+    base_t* get_sentinel() const noexcept {
+        return const_cast<base_t*>(&sentinel);
     }
 
-    void set_root(node_base* new_root) noexcept {
+    void set_root(base_t* new_root) noexcept {
+        tail = nullptr;
         sentinel.left = new_root;
-        set_parent(new_root, &sentinel);
+        link_parent(new_root, &sentinel);
     }
 };
 }
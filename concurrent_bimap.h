@@ -0,0 +1,266 @@
+#pragma once
+
+#include "cartesian_tree.h"
+#include "epoch.h"
+#include "persistent_treap.h"
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// lookups take no locks: they walk an immutable version of both trees
+// under an epoch guard, which keeps retired nodes alive until every reader
+// that could see them is gone. Writers are serialised, path-copy the
+// trees and publish a new version with one atomic store. Lookups return
+// copies, as a reference could outlive the version it points into
+template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>>
+struct concurrent_bimap {
+    using left_t = Left;
+    using right_t = Right;
+    using cmp_left_t = CompareLeft;
+    using cmp_right_t = CompareRight;
+
+    concurrent_bimap(cmp_left_t compare_left = CompareLeft(),
+                     cmp_right_t compare_right = CompareRight())
+        : left_index(compare_left), right_index(compare_right),
+          head(new version{nullptr, nullptr, 0}) {}
+
+    concurrent_bimap(concurrent_bimap const&) = delete;
+    concurrent_bimap& operator=(concurrent_bimap const&) = delete;
+
+    // no reader may be inside the bimap any more
+    ~concurrent_bimap() {
+        version const* current = head.load();
+        for (entry const* e : collect_entries(current->left_root)) {
+            delete e;
+        }
+        nodes_t::destroy(current->left_root);
+        nodes_t::destroy(current->right_root);
+        delete current;
+        for (garbage& g : retired) {
+            g.release();
+        }
+    }
+
+    bool insert(left_t left, right_t right) {
+        std::lock_guard<std::mutex> lock(writer);
+        version const* current = head.load(std::memory_order_relaxed);
+        if (left_index.find(current->left_root, left) != nullptr ||
+            right_index.find(current->right_root, right) != nullptr) {
+            return false;
+        }
+        garbage& g = prepare_garbage();
+        entry* e = nullptr;
+        try {
+            g.left.reserve(left_index.copy_bound(current->left_root, left));
+            g.right.reserve(
+                right_index.copy_bound(current->right_root, right));
+            e = new entry{std::move(left), std::move(right)};
+            uint32_t priority = details::get_next_random_uint32_t();
+            version* next = new version{
+                left_index.insert(current->left_root, e, priority, g.left),
+                right_index.insert(current->right_root, e, priority,
+                                   g.right),
+                current->size + 1};
+            publish(next, g);
+        } catch (...) {
+            delete e;
+            drop_garbage();
+            throw;
+        }
+        return true;
+    }
+
+    bool erase_left(left_t const& left) {
+        std::lock_guard<std::mutex> lock(writer);
+        version const* current = head.load(std::memory_order_relaxed);
+        left_node const* found = left_index.find(current->left_root, left);
+        if (found == nullptr) {
+            return false;
+        }
+        erase(current, found->entry);
+        return true;
+    }
+
+    bool erase_right(right_t const& right) {
+        std::lock_guard<std::mutex> lock(writer);
+        version const* current = head.load(std::memory_order_relaxed);
+        right_node const* found =
+            right_index.find(current->right_root, right);
+        if (found == nullptr) {
+            return false;
+        }
+        erase(current, found->entry);
+        return true;
+    }
+
+    std::optional<right_t> find_left(left_t const& left) const {
+        details::epoch_guard guard;
+        left_node const* found = left_index.find(head.load()->left_root, left);
+        if (found == nullptr) {
+            return std::nullopt;
+        }
+        return found->entry->right;
+    }
+
+    std::optional<left_t> find_right(right_t const& right) const {
+        details::epoch_guard guard;
+        right_node const* found =
+            right_index.find(head.load()->right_root, right);
+        if (found == nullptr) {
+            return std::nullopt;
+        }
+        return found->entry->left;
+    }
+
+    right_t at_left(left_t const& key) const {
+        std::optional<right_t> found = find_left(key);
+        if (!found) {
+            throw std::out_of_range("there is no such value in bimap");
+        }
+        return std::move(*found);
+    }
+
+    left_t at_right(right_t const& key) const {
+        std::optional<left_t> found = find_right(key);
+        if (!found) {
+            throw std::out_of_range("there is no such value in bimap");
+        }
+        return std::move(*found);
+    }
+
+    std::size_t size() const noexcept {
+        details::epoch_guard guard;
+        return head.load()->size;
+    }
+
+    bool empty() const noexcept {
+        return size() == 0;
+    }
+
+  private:
+    struct entry {
+        left_t left;
+        right_t right;
+    };
+
+    struct left_key {
+        left_t const& operator()(entry const& e) const noexcept {
+            return e.left;
+        }
+    };
+
+    struct right_key {
+        right_t const& operator()(entry const& e) const noexcept {
+            return e.right;
+        }
+    };
+
+    using nodes_t = details::retired_nodes<entry>;
+    using left_index_t =
+        details::persistent_treap<entry, left_key, cmp_left_t, nodes_t>;
+    using right_index_t =
+        details::persistent_treap<entry, right_key, cmp_right_t, nodes_t>;
+    using left_node = typename left_index_t::node_t;
+    using right_node = typename right_index_t::node_t;
+
+    struct version {
+        left_node const* left_root;
+        right_node const* right_root;
+        std::size_t size;
+    };
+
+    // what a published write unlinked, freed once its epoch is quiescent
+    struct garbage {
+        uint64_t tag{0};
+        typename left_index_t::copy_t left;
+        typename right_index_t::copy_t right;
+        version const* old_version{nullptr};
+        entry const* erased{nullptr};
+
+        void release() noexcept {
+            for (left_node const* v : left.retired) {
+                delete v;
+            }
+            for (right_node const* v : right.retired) {
+                delete v;
+            }
+            delete old_version;
+            delete erased;
+        }
+    };
+
+    garbage& prepare_garbage() {
+        retired.emplace_back();
+        return retired.back();
+    }
+
+    void drop_garbage() noexcept {
+        retired.back().left.rollback();
+        retired.back().right.rollback();
+        retired.pop_back();
+    }
+
+    void publish(version const* next, garbage& g) noexcept {
+        g.old_version = head.load(std::memory_order_relaxed);
+        head.store(next);
+        g.tag = details::advance_epoch();
+        g.left.created.clear();
+        g.right.created.clear();
+        while (!retired.empty() &&
+               details::epoch_quiescent(retired.front().tag)) {
+            retired.front().release();
+            retired.pop_front();
+        }
+    }
+
+    void erase(version const* current, entry const* e) {
+        garbage& g = prepare_garbage();
+        try {
+            g.left.reserve(left_index.copy_bound(current->left_root, e->left));
+            g.right.reserve(
+                right_index.copy_bound(current->right_root, e->right));
+            version* next = new version{
+                left_index.erase(current->left_root, e->left, g.left),
+                right_index.erase(current->right_root, e->right, g.right),
+                current->size - 1};
+            g.erased = e;
+            publish(next, g);
+        } catch (...) {
+            drop_garbage();
+            throw;
+        }
+    }
+
+    static std::vector<entry const*> collect_entries(left_node const* root) {
+        std::vector<entry const*> result;
+        std::vector<left_node const*> stack;
+        if (root != nullptr) {
+            stack.push_back(root);
+        }
+        while (!stack.empty()) {
+            left_node const* v = stack.back();
+            stack.pop_back();
+            result.push_back(v->entry);
+            if (v->left != nullptr) {
+                stack.push_back(v->left);
+            }
+            if (v->right != nullptr) {
+                stack.push_back(v->right);
+            }
+        }
+        return result;
+    }
+
+    left_index_t left_index;
+    right_index_t right_index;
+    std::atomic<version const*> head;
+    std::mutex writer;
+    std::deque<garbage> retired;
+};
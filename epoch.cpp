@@ -0,0 +1,71 @@
+#include "epoch.h"
+#include <atomic>
+#include <limits>
+
+struct details::epoch_slot {
+    static constexpr uint64_t idle = std::numeric_limits<uint64_t>::max();
+
+    alignas(64) std::atomic<uint64_t> epoch{idle};
+    std::atomic<bool> used{true};
+    epoch_slot* next{nullptr};
+    unsigned depth{0};
+};
+
+namespace {
+std::atomic<uint64_t> global_epoch{0};
+std::atomic<details::epoch_slot*> slots{nullptr};
+
+// slots are never freed, a thread that exits hands its slot to the next one
+details::epoch_slot* acquire_slot() {
+    for (details::epoch_slot* s = slots.load(); s != nullptr; s = s->next) {
+        bool used = false;
+        if (s->used.compare_exchange_strong(used, true)) {
+            return s;
+        }
+    }
+    details::epoch_slot* s = new details::epoch_slot;
+    s->next = slots.load();
+    while (!slots.compare_exchange_weak(s->next, s)) {
+    }
+    return s;
+}
+
+struct slot_owner {
+    details::epoch_slot* slot{acquire_slot()};
+
+    ~slot_owner() {
+        slot->used.store(false);
+    }
+};
+
+details::epoch_slot* thread_slot() {
+    thread_local slot_owner owner;
+    return owner.slot;
+}
+} // namespace
+
+uint64_t details::advance_epoch() noexcept {
+    return global_epoch.fetch_add(1);
+}
+
+bool details::epoch_quiescent(uint64_t tag) noexcept {
+    for (epoch_slot* s = slots.load(); s != nullptr; s = s->next) {
+        uint64_t epoch = s->epoch.load();
+        if (epoch <= tag) {
+            return false;
+        }
+    }
+    return true;
+}
+
+details::epoch_guard::epoch_guard() : slot(thread_slot()) {
+    if (slot->depth++ == 0) {
+        slot->epoch.store(global_epoch.load());
+    }
+}
+
+details::epoch_guard::~epoch_guard() {
+    if (--slot->depth == 0) {
+        slot->epoch.store(epoch_slot::idle, std::memory_order_release);
+    }
+}
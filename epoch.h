@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdint>
+
+namespace details {
+
+struct epoch_slot;
+
+// tag for objects unlinked from a structure readers may still be walking
+uint64_t advance_epoch() noexcept;
+
+// true once no reader can still hold anything retired with tag
+bool epoch_quiescent(uint64_t tag) noexcept;
+
+// marks the current thread as reading; guards nest
+struct epoch_guard {
+    epoch_guard();
+    epoch_guard(epoch_guard const&) = delete;
+    epoch_guard& operator=(epoch_guard const&) = delete;
+    ~epoch_guard();
+
+  private:
+    epoch_slot* slot;
+};
+} // namespace details
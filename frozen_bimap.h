@@ -0,0 +1,365 @@
+#pragma once
+
+#include "snapshot.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace details {
+
+// the sections of a mapped snapshot, read in place
+template <typename Left, typename Right>
+struct frozen_file {
+    explicit frozen_file(std::string const& path)
+        : file(path, mapped_file::access::random),
+          layout(check_snapshot_header(file.data(), file.size(), sizeof(Left),
+                                       sizeof(Right))),
+          lefts(section<Left>(layout.lefts)),
+          rights(section<Right>(layout.rights)),
+          left_partners(section<uint64_t>(layout.left_partners)),
+          right_partners(section<uint64_t>(layout.right_partners)) {}
+
+    template <typename T>
+    T const* section(std::size_t offset) const noexcept {
+        return std::launder(reinterpret_cast<T const*>(file.data() + offset));
+    }
+
+    mapped_file file;
+    snapshot_layout layout;
+    Left const* lefts;
+    Right const* rights;
+    uint64_t const* left_partners;
+    uint64_t const* right_partners;
+};
+} // namespace details
+
+// read-only bimap over a snapshot written by bimap::save. The file is
+// mapped and searched where it lies, so opening costs O(1) whatever the
+// size, and processes opening the same file share its pages. Copies share
+// the mapping, and iterators stay valid while any copy lives. Load with
+// the comparators the file was saved with; the constructor only checks
+// the header, verify() checks the contents. Until then the contents are
+// trusted only as far as memory safety goes: a damaged order gives wrong
+// answers, a partner index past the end flips to the end and makes at_left
+// and at_right throw snapshot_error, but nothing is read outside the file
+template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>>
+struct frozen_bimap {
+    using left_t = Left;
+    using right_t = Right;
+    using cmp_left_t = CompareLeft;
+    using cmp_right_t = CompareRight;
+
+    static_assert(std::is_trivially_copyable_v<left_t> &&
+                      std::is_trivially_copyable_v<right_t>,
+                  "frozen_bimap reads keys in place");
+    static_assert(
+        alignof(left_t) <= details::snapshot_header::section_alignment &&
+            alignof(right_t) <= details::snapshot_header::section_alignment,
+        "keys are aligned beyond what a snapshot section guarantees");
+
+  private:
+    using file_t = details::frozen_file<left_t, right_t>;
+
+    template <typename T, typename Other, bool IsLeft>
+    struct base_iterator {
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using reference = T const&;
+        using pointer = T const*;
+        using difference_type = std::ptrdiff_t;
+
+        base_iterator() = default;
+
+        T const& operator*() const noexcept {
+            return keys()[pos];
+        }
+
+        T const* operator->() const noexcept {
+            return &**this;
+        }
+
+        base_iterator& operator++() noexcept {
+            pos++;
+            return *this;
+        }
+
+        base_iterator operator++(int) noexcept {
+            base_iterator copy = *this;
+            ++*this;
+            return copy;
+        }
+
+        base_iterator& operator--() noexcept {
+            pos--;
+            return *this;
+        }
+
+        base_iterator operator--(int) noexcept {
+            base_iterator copy = *this;
+            --*this;
+            return copy;
+        }
+
+        base_iterator& operator+=(difference_type n) noexcept {
+            pos += n;
+            return *this;
+        }
+
+        base_iterator& operator-=(difference_type n) noexcept {
+            return *this += -n;
+        }
+
+        friend base_iterator operator+(base_iterator it,
+                                       difference_type n) noexcept {
+            return it += n;
+        }
+
+        friend base_iterator operator-(base_iterator it,
+                                       difference_type n) noexcept {
+            return it -= n;
+        }
+
+        friend difference_type operator-(base_iterator const& a,
+                                         base_iterator const& b) noexcept {
+            return static_cast<difference_type>(a.pos) -
+                   static_cast<difference_type>(b.pos);
+        }
+
+        bool operator==(base_iterator const& other) const noexcept {
+            return pos == other.pos && file == other.file;
+        }
+
+        bool operator!=(base_iterator const& other) const noexcept {
+            return !(*this == other);
+        }
+
+        using another_iterator = base_iterator<Other, T, !IsLeft>;
+
+        another_iterator flip() const noexcept {
+            std::size_t count = file->layout.count;
+            if (pos == count || partners()[pos] >= count) {
+                return another_iterator(file, count);
+            }
+            return another_iterator(file, partners()[pos]);
+        }
+
+      private:
+        friend struct frozen_bimap;
+        friend another_iterator;
+
+        base_iterator(file_t const* file, std::size_t pos) noexcept
+            : file(file), pos(pos) {}
+
+        T const* keys() const noexcept {
+            if constexpr (IsLeft) {
+                return file->lefts;
+            } else {
+                return file->rights;
+            }
+        }
+
+        uint64_t const* partners() const noexcept {
+            if constexpr (IsLeft) {
+                return file->left_partners;
+            } else {
+                return file->right_partners;
+            }
+        }
+
+        file_t const* file{nullptr};
+        std::size_t pos{0};
+    };
+
+  public:
+    using left_iterator = base_iterator<left_t, right_t, true>;
+    using right_iterator = base_iterator<right_t, left_t, false>;
+
+    // throws std::system_error if the file cannot be mapped and
+    // snapshot_error if its header does not fit these types
+    explicit frozen_bimap(std::string const& path,
+                          CompareLeft compare_left = CompareLeft(),
+                          CompareRight compare_right = CompareRight())
+        : file(std::make_shared<file_t const>(path)),
+          compare_left(std::move(compare_left)),
+          compare_right(std::move(compare_right)) {}
+
+    // checksum, order and pairing of the whole file, O(n); throws
+    // snapshot_error
+    void verify() const {
+        details::check_snapshot_checksum(file->file.data(), file->layout);
+        details::check_snapshot_order<left_t, right_t>(
+            file->file.data(), file->layout, compare_left, compare_right);
+    }
+
+    left_iterator find_left(left_t const& left) const {
+        return find_impl(left, begin_left(), end_left(), compare_left);
+    }
+
+    template <typename K, typename C = cmp_left_t,
+              typename = typename C::is_transparent>
+    left_iterator find_left(K const& left) const {
+        return find_impl(left, begin_left(), end_left(), compare_left);
+    }
+
+    right_iterator find_right(right_t const& right) const {
+        return find_impl(right, begin_right(), end_right(), compare_right);
+    }
+
+    template <typename K, typename C = cmp_right_t,
+              typename = typename C::is_transparent>
+    right_iterator find_right(K const& right) const {
+        return find_impl(right, begin_right(), end_right(), compare_right);
+    }
+
+    right_t const& at_left(left_t const& key) const {
+        return at_impl(find_left(key), end_left());
+    }
+
+    template <typename K, typename C = cmp_left_t,
+              typename = typename C::is_transparent>
+    right_t const& at_left(K const& key) const {
+        return at_impl(find_left(key), end_left());
+    }
+
+    left_t const& at_right(right_t const& key) const {
+        return at_impl(find_right(key), end_right());
+    }
+
+    template <typename K, typename C = cmp_right_t,
+              typename = typename C::is_transparent>
+    left_t const& at_right(K const& key) const {
+        return at_impl(find_right(key), end_right());
+    }
+
+    left_iterator lower_bound_left(left_t const& left) const {
+        return lower_bound_impl(left, begin_left(), compare_left);
+    }
+
+    template <typename K, typename C = cmp_left_t,
+              typename = typename C::is_transparent>
+    left_iterator lower_bound_left(K const& left) const {
+        return lower_bound_impl(left, begin_left(), compare_left);
+    }
+
+    left_iterator upper_bound_left(left_t const& left) const {
+        return upper_bound_impl(left, begin_left(), compare_left);
+    }
+
+    template <typename K, typename C = cmp_left_t,
+              typename = typename C::is_transparent>
+    left_iterator upper_bound_left(K const& left) const {
+        return upper_bound_impl(left, begin_left(), compare_left);
+    }
+
+    right_iterator lower_bound_right(right_t const& right) const {
+        return lower_bound_impl(right, begin_right(), compare_right);
+    }
+
+    template <typename K, typename C = cmp_right_t,
+              typename = typename C::is_transparent>
+    right_iterator lower_bound_right(K const& right) const {
+        return lower_bound_impl(right, begin_right(), compare_right);
+    }
+
+    right_iterator upper_bound_right(right_t const& right) const {
+        return upper_bound_impl(right, begin_right(), compare_right);
+    }
+
+    template <typename K, typename C = cmp_right_t,
+              typename = typename C::is_transparent>
+    right_iterator upper_bound_right(K const& right) const {
+        return upper_bound_impl(right, begin_right(), compare_right);
+    }
+
+    left_iterator nth_left(std::size_t k) const noexcept {
+        return left_iterator(file.get(), std::min(k, size()));
+    }
+
+    right_iterator nth_right(std::size_t k) const noexcept {
+        return right_iterator(file.get(), std::min(k, size()));
+    }
+
+    std::size_t rank_left(left_t const& left) const {
+        return lower_bound_left(left) - begin_left();
+    }
+
+    std::size_t rank_right(right_t const& right) const {
+        return lower_bound_right(right) - begin_right();
+    }
+
+    left_iterator begin_left() const noexcept {
+        return left_iterator(file.get(), 0);
+    }
+    left_iterator end_left() const noexcept {
+        return left_iterator(file.get(), size());
+    }
+
+    right_iterator begin_right() const noexcept {
+        return right_iterator(file.get(), 0);
+    }
+    right_iterator end_right() const noexcept {
+        return right_iterator(file.get(), size());
+    }
+
+    bool empty() const noexcept {
+        return size() == 0;
+    }
+
+    std::size_t size() const noexcept {
+        return file->layout.count;
+    }
+
+  private:
+    template <typename K, typename Iterator, typename Compare>
+    static Iterator lower_bound_impl(K const& key, Iterator first,
+                                     Compare const& compare) {
+        auto const* keys = first.keys();
+        auto const* found = std::lower_bound(
+            keys, keys + first.file->layout.count, key, compare);
+        return Iterator(first.file, found - keys);
+    }
+
+    template <typename K, typename Iterator, typename Compare>
+    static Iterator upper_bound_impl(K const& key, Iterator first,
+                                     Compare const& compare) {
+        auto const* keys = first.keys();
+        auto const* found = std::upper_bound(
+            keys, keys + first.file->layout.count, key, compare);
+        return Iterator(first.file, found - keys);
+    }
+
+    template <typename K, typename Iterator, typename Compare>
+    static Iterator find_impl(K const& key, Iterator first, Iterator last,
+                              Compare const& compare) {
+        Iterator found = lower_bound_impl(key, first, compare);
+        if (found == last || compare(key, *found)) {
+            return last;
+        }
+        return found;
+    }
+
+    template <typename Iterator>
+    static auto const& at_impl(Iterator found, Iterator last) {
+        if (found == last) {
+            throw std::out_of_range("there is no such value in bimap");
+        }
+        auto partner = found.flip();
+        if (partner.pos == partner.file->layout.count) {
+            throw snapshot_error("snapshot partner index is out of range");
+        }
+        return *partner;
+    }
+
+    std::shared_ptr<file_t const> file;
+    cmp_left_t compare_left;
+    cmp_right_t compare_right;
+};
@@ -0,0 +1,61 @@
+#include "node_pool.h"
+#include <algorithm>
+
+namespace {
+std::size_t round_up(std::size_t x, std::size_t align) noexcept {
+    return (x + align - 1) / align * align;
+}
+} // namespace
+
+void* details::node_pool::allocate(std::size_t size, std::size_t align) {
+    if (block_size == 0) {
+        block_align = std::max(align, alignof(free_block));
+        block_size = round_up(std::max(size, sizeof(free_block)), block_align);
+    }
+    if (!fits(size, align)) {
+        return ::operator new(size, std::align_val_t(align));
+    }
+    if (free_list != nullptr) {
+        free_block* result = free_list;
+        free_list = free_list->next;
+        return result;
+    }
+    if (bump == bump_end) {
+        add_chunk();
+    }
+    void* result = bump;
+    bump += block_size;
+    return result;
+}
+
+void details::node_pool::deallocate(void* p, std::size_t size,
+                                    std::size_t align) noexcept {
+    if (!fits(size, align)) {
+        ::operator delete(p, std::align_val_t(align));
+        return;
+    }
+    free_list = ::new (p) free_block{free_list};
+}
+
+void details::node_pool::release() noexcept {
+    std::size_t chunk_align = std::max(block_align, alignof(chunk_header));
+    while (chunks != nullptr) {
+        chunk_header* next = chunks->next;
+        ::operator delete(chunks, std::align_val_t(chunk_align));
+        chunks = next;
+    }
+    free_list = nullptr;
+    bump = bump_end = nullptr;
+}
+
+void details::node_pool::add_chunk() {
+    std::size_t chunk_align = std::max(block_align, alignof(chunk_header));
+    std::size_t header = round_up(sizeof(chunk_header), chunk_align);
+    std::size_t bytes = header + next_chunk_blocks * block_size;
+    char* memory = static_cast<char*>(
+        ::operator new(bytes, std::align_val_t(chunk_align)));
+    chunks = ::new (memory) chunk_header{chunks};
+    bump = memory + header;
+    bump_end = memory + bytes;
+    next_chunk_blocks = std::min(next_chunk_blocks * 2, max_chunk_blocks);
+}
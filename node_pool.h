@@ -0,0 +1,106 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+namespace details {
+
+struct node_pool {
+
+    explicit node_pool(std::size_t first_chunk_blocks = 32) noexcept
+        : next_chunk_blocks(first_chunk_blocks) {}
+
+    node_pool(node_pool const&) = delete;
+    node_pool& operator=(node_pool const&) = delete;
+
+    ~node_pool() {
+        release();
+    }
+
+    void* allocate(std::size_t size, std::size_t align);
+
+    void deallocate(void* p, std::size_t size, std::size_t align) noexcept;
+
+    void release() noexcept;
+
+  private:
+    struct free_block {
+        free_block* next;
+    };
+
+    struct chunk_header {
+        chunk_header* next;
+    };
+
+    static constexpr std::size_t max_chunk_blocks = 4096;
+
+    bool fits(std::size_t size, std::size_t align) const noexcept {
+        return block_size != 0 && size <= block_size &&
+               align <= block_align;
+    }
+
+    void add_chunk();
+
+    std::size_t block_size{0};
+    std::size_t block_align{0};
+    std::size_t next_chunk_blocks;
+    free_block* free_list{nullptr};
+    char* bump{nullptr};
+    char* bump_end{nullptr};
+    chunk_header* chunks{nullptr};
+};
+} // namespace details
+
+template <typename T>
+struct pool_allocator {
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    pool_allocator() : pool(std::make_shared<details::node_pool>()) {}
+
+    pool_allocator(pool_allocator const&) noexcept = default;
+
+    template <typename U>
+    pool_allocator(pool_allocator<U> const& other) noexcept
+        : pool(other.pool) {}
+
+    T* allocate(std::size_t n) {
+        if (n == 1) {
+            return static_cast<T*>(pool->allocate(sizeof(T), alignof(T)));
+        }
+        return static_cast<T*>(
+            ::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        if (n == 1) {
+            pool->deallocate(p, sizeof(T), alignof(T));
+        } else {
+            ::operator delete(p, std::align_val_t(alignof(T)));
+        }
+    }
+
+    pool_allocator select_on_container_copy_construction() const {
+        return pool_allocator();
+    }
+
+    template <typename U>
+    bool operator==(pool_allocator<U> const& other) const noexcept {
+        return pool == other.pool;
+    }
+
+    template <typename U>
+    bool operator!=(pool_allocator<U> const& other) const noexcept {
+        return pool != other.pool;
+    }
+
+    template <typename U>
+    friend struct pool_allocator;
+
+  private:
+    std::shared_ptr<details::node_pool> pool;
+};
@@ -0,0 +1,54 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <system_error>
+#include <thread>
+
+namespace details {
+
+// below this many elements a task is not worth a thread
+constexpr std::size_t parallel_cutoff = 1 << 14;
+
+inline unsigned default_threads() noexcept {
+    unsigned threads = std::thread::hardware_concurrency();
+    return (threads == 0 ? 1 : threads);
+}
+
+// runs f on a new thread and g on the current one; both run here when
+// fewer than two threads are allowed or no thread can be started
+template <typename F, typename G>
+void fork_join(unsigned threads, F&& f, G&& g) {
+    if (threads > 1) {
+        std::thread worker;
+        try {
+            worker = std::thread(std::ref(f));
+        } catch (std::system_error const&) {
+        }
+        if (worker.joinable()) {
+            g();
+            worker.join();
+            return;
+        }
+    }
+    f();
+    g();
+}
+
+// stable, as the halves are merged in order
+template <typename RandomIt, typename Less>
+void parallel_sort(RandomIt first, RandomIt last, Less const& less,
+                   unsigned threads) {
+    if (threads < 2 ||
+        static_cast<std::size_t>(last - first) < parallel_cutoff) {
+        std::stable_sort(first, last, less);
+        return;
+    }
+    RandomIt mid = first + (last - first) / 2;
+    fork_join(
+        threads,
+        [&] { parallel_sort(first, mid, less, threads / 2); },
+        [&] { parallel_sort(mid, last, less, threads - threads / 2); });
+    std::inplace_merge(first, mid, last, less);
+}
+} // namespace details
@@ -0,0 +1,288 @@
+#pragma once
+
+#include "cartesian_tree.h"
+#include "persistent_treap.h"
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// a bimap whose copies share structure: snapshot() and copying are O(1),
+// and a write to one copy path-copies O(log n) nodes without affecting
+// the others. Both trees of a pair point at one shared entry, and a
+// version owns both of its roots, so the two sides always agree.
+// Iterators are forward only and stay valid while the bimap they came
+// from is not modified
+template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>>
+struct persistent_bimap {
+    using left_t = Left;
+    using right_t = Right;
+    using cmp_left_t = CompareLeft;
+    using cmp_right_t = CompareRight;
+
+  private:
+    struct entry {
+        left_t left;
+        right_t right;
+        mutable std::atomic<std::size_t> refs{0};
+    };
+
+    struct left_key {
+        left_t const& operator()(entry const& e) const noexcept {
+            return e.left;
+        }
+    };
+
+    struct right_key {
+        right_t const& operator()(entry const& e) const noexcept {
+            return e.right;
+        }
+    };
+
+    using nodes_t = details::counted_nodes<entry>;
+    using left_index_t =
+        details::persistent_treap<entry, left_key, cmp_left_t, nodes_t>;
+    using right_index_t =
+        details::persistent_treap<entry, right_key, cmp_right_t, nodes_t>;
+
+  public:
+    template <typename Index, typename OtherIndex>
+    struct base_iterator {
+      private:
+        using node_t = typename Index::node_t;
+        using key_of = std::conditional_t<std::is_same_v<Index, left_index_t>,
+                                          left_key, right_key>;
+
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type =
+            std::decay_t<decltype(key_of()(std::declval<entry const&>()))>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = value_type const*;
+        using reference = value_type const&;
+        using another_iterator = base_iterator<OtherIndex, Index>;
+
+        base_iterator() = default;
+
+        reference operator*() const noexcept {
+            return key_of()(*path.back()->entry);
+        }
+
+        pointer operator->() const noexcept {
+            return &**this;
+        }
+
+        base_iterator& operator++() {
+            node_t const* v = path.back();
+            if (v->right) {
+                for (v = v->right.get(); v != nullptr; v = v->left.get()) {
+                    path.push_back(v);
+                }
+                return *this;
+            }
+            node_t const* child;
+            do {
+                child = path.back();
+                path.pop_back();
+            } while (!path.empty() && path.back()->right.get() == child);
+            return *this;
+        }
+
+        base_iterator operator++(int) {
+            base_iterator copy = *this;
+            ++*this;
+            return copy;
+        }
+
+        bool operator==(base_iterator const& other) const noexcept {
+            return (path.empty() ? other.path.empty()
+                                 : !other.path.empty() &&
+                                       path.back() == other.path.back());
+        }
+
+        bool operator!=(base_iterator const& other) const noexcept {
+            return !(*this == other);
+        }
+
+        // O(log n), the other side is searched by key
+        another_iterator flip() const {
+            if (path.empty()) {
+                return another_iterator(owner, {});
+            }
+            return owner->template find_path<another_iterator>(
+                *path.back()->entry);
+        }
+
+        friend struct persistent_bimap;
+
+      private:
+        base_iterator(persistent_bimap const* owner,
+                      std::vector<node_t const*> path)
+            : owner(owner), path(std::move(path)) {}
+
+        persistent_bimap const* owner{nullptr};
+        std::vector<node_t const*> path;
+    };
+
+    using left_iterator = base_iterator<left_index_t, right_index_t>;
+    using right_iterator = base_iterator<right_index_t, left_index_t>;
+
+    persistent_bimap(cmp_left_t compare_left = CompareLeft(),
+                     cmp_right_t compare_right = CompareRight())
+        : left_index(std::move(compare_left)),
+          right_index(std::move(compare_right)) {}
+
+    persistent_bimap(persistent_bimap const&) = default;
+    persistent_bimap& operator=(persistent_bimap const&) = default;
+
+    persistent_bimap(persistent_bimap&& other) noexcept
+        : left_index(other.left_index), right_index(other.right_index),
+          left_root(std::move(other.left_root)),
+          right_root(std::move(other.right_root)),
+          count(std::exchange(other.count, 0)) {}
+
+    persistent_bimap& operator=(persistent_bimap&& other) noexcept {
+        if (this != &other) {
+            left_index = other.left_index;
+            right_index = other.right_index;
+            left_root = std::move(other.left_root);
+            right_root = std::move(other.right_root);
+            count = std::exchange(other.count, 0);
+        }
+        return *this;
+    }
+
+    // the current contents, unaffected by later writes to either bimap
+    persistent_bimap snapshot() const noexcept {
+        return *this;
+    }
+
+    bool insert(left_t left, right_t right) {
+        if (left_index.find(left_root.get(), left) != nullptr ||
+            right_index.find(right_root.get(), right) != nullptr) {
+            return false;
+        }
+        entry_ref e(new entry{std::move(left), std::move(right)});
+        uint32_t priority = details::get_next_random_uint32_t();
+        typename nodes_t::copy_t copy;
+        node_ref<left_index_t> next_left =
+            left_index.insert(left_root, e, priority, copy);
+        right_root = right_index.insert(right_root, e, priority, copy);
+        left_root = std::move(next_left);
+        count++;
+        return true;
+    }
+
+    bool erase_left(left_t const& left) {
+        auto const* found = left_index.find(left_root.get(), left);
+        if (found == nullptr) {
+            return false;
+        }
+        erase(found->entry);
+        return true;
+    }
+
+    bool erase_right(right_t const& right) {
+        auto const* found = right_index.find(right_root.get(), right);
+        if (found == nullptr) {
+            return false;
+        }
+        erase(found->entry);
+        return true;
+    }
+
+    left_iterator find_left(left_t const& left) const {
+        return left_iterator(this, left_index.path_to(left_root.get(), left));
+    }
+
+    right_iterator find_right(right_t const& right) const {
+        return right_iterator(this,
+                              right_index.path_to(right_root.get(), right));
+    }
+
+    right_t const& at_left(left_t const& key) const {
+        auto const* found = left_index.find(left_root.get(), key);
+        if (found == nullptr) {
+            throw std::out_of_range("there is no such value in bimap");
+        }
+        return found->entry->right;
+    }
+
+    left_t const& at_right(right_t const& key) const {
+        auto const* found = right_index.find(right_root.get(), key);
+        if (found == nullptr) {
+            throw std::out_of_range("there is no such value in bimap");
+        }
+        return found->entry->left;
+    }
+
+    left_iterator begin_left() const {
+        return leftmost<left_iterator>(left_root.get());
+    }
+
+    left_iterator end_left() const noexcept {
+        return left_iterator(this, {});
+    }
+
+    right_iterator begin_right() const {
+        return leftmost<right_iterator>(right_root.get());
+    }
+
+    right_iterator end_right() const noexcept {
+        return right_iterator(this, {});
+    }
+
+    std::size_t size() const noexcept {
+        return count;
+    }
+
+    bool empty() const noexcept {
+        return count == 0;
+    }
+
+  private:
+    using entry_ref = details::shared_ref<entry>;
+
+    template <typename Index>
+    using node_ref = typename Index::ref_t;
+
+    // both roots are built before either is replaced, so a failed
+    // allocation leaves the bimap as it was
+    void erase(entry_ref const& e) {
+        typename nodes_t::copy_t copy;
+        node_ref<left_index_t> next_left =
+            left_index.erase(left_root, e->left, copy);
+        right_root = right_index.erase(right_root, e->right, copy);
+        left_root = std::move(next_left);
+        count--;
+    }
+
+    template <typename Iterator, typename Node>
+    Iterator leftmost(Node const* v) const {
+        std::vector<Node const*> path;
+        for (; v != nullptr; v = v->left.get()) {
+            path.push_back(v);
+        }
+        return Iterator(this, std::move(path));
+    }
+
+    template <typename Iterator>
+    Iterator find_path(entry const& e) const {
+        if constexpr (std::is_same_v<Iterator, left_iterator>) {
+            return find_left(e.left);
+        } else {
+            return find_right(e.right);
+        }
+    }
+
+    left_index_t left_index;
+    right_index_t right_index;
+    node_ref<left_index_t> left_root;
+    node_ref<right_index_t> right_root;
+    std::size_t count{0};
+};
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace details {
+
+// owning pointer to an immutable object with an intrusive atomic count, so
+// versions living on different threads can share it
+template <typename T>
+struct shared_ref {
+    shared_ref() noexcept = default;
+
+    explicit shared_ref(T const* p) noexcept : ptr(p) {
+        acquire();
+    }
+
+    shared_ref(shared_ref const& other) noexcept : ptr(other.ptr) {
+        acquire();
+    }
+
+    shared_ref(shared_ref&& other) noexcept
+        : ptr(std::exchange(other.ptr, nullptr)) {}
+
+    shared_ref& operator=(shared_ref other) noexcept {
+        std::swap(ptr, other.ptr);
+        return *this;
+    }
+
+    ~shared_ref() {
+        if (ptr != nullptr &&
+            ptr->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete ptr;
+        }
+    }
+
+    T const* get() const noexcept {
+        return ptr;
+    }
+
+    T const& operator*() const noexcept {
+        return *ptr;
+    }
+
+    T const* operator->() const noexcept {
+        return ptr;
+    }
+
+    explicit operator bool() const noexcept {
+        return ptr != nullptr;
+    }
+
+  private:
+    void acquire() noexcept {
+        if (ptr != nullptr) {
+            ptr->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    T const* ptr{nullptr};
+};
+
+// the nodes a write replaced and the ones it made on their way
+template <typename Node>
+struct path_copy {
+    std::vector<Node const*> retired;
+    std::vector<Node*> created;
+
+    // room for a write that copies up to n nodes, so that recording them
+    // cannot fail halfway
+    void reserve(std::size_t n) {
+        retired.reserve(n);
+        created.reserve(n);
+    }
+
+    void rollback() noexcept {
+        for (Node* v : created) {
+            delete v;
+        }
+        created.clear();
+        retired.clear();
+    }
+};
+
+// plain nodes; a write records what it replaced, and the owner frees that
+// once no reader can see it any more. The owner reserves the copy for the
+// write beforehand, see persistent_treap::copy_bound
+template <typename Entry>
+struct retired_nodes {
+    struct node_t {
+        node_t const* left;
+        node_t const* right;
+        Entry const* entry;
+        uint32_t priority;
+    };
+
+    using ref_t = node_t const*;
+    using entry_ref = Entry const*;
+    using copy_t = path_copy<node_t>;
+
+    static node_t const* get(ref_t v) noexcept {
+        return v;
+    }
+
+    static ref_t make(ref_t left, ref_t right, entry_ref entry,
+                      uint32_t priority, copy_t& copy) {
+        node_t* result = new node_t{left, right, entry, priority};
+        copy.created.push_back(result);
+        return result;
+    }
+
+    static void retire(node_t const* v, copy_t& copy) noexcept {
+        copy.retired.push_back(v);
+    }
+
+    // frees a whole tree, flattening it by rotations instead of a stack
+    static void destroy(node_t const* v) noexcept {
+        while (v != nullptr) {
+            if (v->left != nullptr) {
+                node_t* left = const_cast<node_t*>(v->left);
+                const_cast<node_t*>(v)->left = left->right;
+                left->right = v;
+                v = left;
+            } else {
+                node_t const* next = v->right;
+                delete v;
+                v = next;
+            }
+        }
+    }
+};
+
+// reference counted nodes; a node goes away with the last version that
+// holds it, so there is nothing to record
+template <typename Entry>
+struct counted_nodes {
+    struct node_t {
+        shared_ref<node_t> left;
+        shared_ref<node_t> right;
+        shared_ref<Entry> entry;
+        uint32_t priority;
+        mutable std::atomic<std::size_t> refs{0};
+    };
+
+    using ref_t = shared_ref<node_t>;
+    using entry_ref = shared_ref<Entry>;
+
+    struct copy_t {};
+
+    static node_t const* get(ref_t const& v) noexcept {
+        return v.get();
+    }
+
+    static ref_t make(ref_t left, ref_t right, entry_ref entry,
+                      uint32_t priority, copy_t&) {
+        return ref_t(new node_t{std::move(left), std::move(right),
+                                std::move(entry), priority});
+    }
+
+    static void retire(node_t const*, copy_t&) noexcept {}
+};
+
+// a treap whose nodes never change once reachable: every write copies the
+// path it touches and returns a new root, so whoever holds an old root
+// keeps seeing a consistent tree. Nodes says how nodes are owned and how
+// the replaced ones are released
+template <typename Entry, typename KeyOf, typename Comparator, typename Nodes>
+struct persistent_treap : Comparator {
+    using node_t = typename Nodes::node_t;
+    using ref_t = typename Nodes::ref_t;
+    using entry_ref = typename Nodes::entry_ref;
+    using copy_t = typename Nodes::copy_t;
+
+    persistent_treap(Comparator const& cmp) : Comparator(cmp) {}
+
+    template <typename K>
+    node_t const* find(node_t const* v, K const& key) const noexcept {
+        while (v != nullptr) {
+            if (less(key, key_of(v))) {
+                v = get(v->left);
+            } else if (less(key_of(v), key)) {
+                v = get(v->right);
+            } else {
+                return v;
+            }
+        }
+        return nullptr;
+    }
+
+    // the path from the root to key, empty if it is not there
+    template <typename K>
+    std::vector<node_t const*> path_to(node_t const* v, K const& key) const {
+        std::vector<node_t const*> path;
+        while (v != nullptr) {
+            path.push_back(v);
+            if (less(key, key_of(v))) {
+                v = get(v->left);
+            } else if (less(key_of(v), key)) {
+                v = get(v->right);
+            } else {
+                return path;
+            }
+        }
+        path.clear();
+        return path;
+    }
+
+    // how many nodes an insert or erase of key copies at most: one for
+    // every node on its search path, the new one, and for an erase the two
+    // spines merged in place of the key
+    template <typename K>
+    std::size_t copy_bound(node_t const* v, K const& key) const noexcept {
+        std::size_t result = 1;
+        while (v != nullptr) {
+            result++;
+            if (less(key, key_of(v))) {
+                v = get(v->left);
+            } else if (less(key_of(v), key)) {
+                v = get(v->right);
+            } else {
+                for (node_t const* u = get(v->left); u != nullptr;
+                     u = get(u->right)) {
+                    result++;
+                }
+                for (node_t const* u = get(v->right); u != nullptr;
+                     u = get(u->left)) {
+                    result++;
+                }
+                break;
+            }
+        }
+        return result;
+    }
+
+    ref_t insert(ref_t const& v, entry_ref const& entry, uint32_t priority,
+                 copy_t& copy) const {
+        if (!v || get(v)->priority < priority) {
+            auto [left, right] = split(v, KeyOf()(*entry), copy);
+            return Nodes::make(std::move(left), std::move(right), entry,
+                               priority, copy);
+        }
+        ref_t result =
+            (less(KeyOf()(*entry), key_of(get(v)))
+                 ? Nodes::make(insert(v->left, entry, priority, copy),
+                               v->right, v->entry, v->priority, copy)
+                 : Nodes::make(v->left, insert(v->right, entry, priority, copy),
+                               v->entry, v->priority, copy));
+        Nodes::retire(get(v), copy);
+        return result;
+    }
+
+    // key must be in the tree
+    template <typename K>
+    ref_t erase(ref_t const& v, K const& key, copy_t& copy) const {
+        ref_t result;
+        if (less(key, key_of(get(v)))) {
+            result = Nodes::make(erase(v->left, key, copy), v->right,
+                                 v->entry, v->priority, copy);
+        } else if (less(key_of(get(v)), key)) {
+            result = Nodes::make(v->left, erase(v->right, key, copy),
+                                 v->entry, v->priority, copy);
+        } else {
+            result = merge(v->left, v->right, copy);
+        }
+        Nodes::retire(get(v), copy);
+        return result;
+    }
+
+  private:
+    template <typename X, typename Y>
+    bool less(X const& x, Y const& y) const noexcept {
+        return static_cast<Comparator const&>(*this)(x, y);
+    }
+
+    static node_t const* get(ref_t const& v) noexcept {
+        return Nodes::get(v);
+    }
+
+    static auto const& key_of(node_t const* v) noexcept {
+        return KeyOf()(*v->entry);
+    }
+
+    template <typename K>
+    std::pair<ref_t, ref_t> split(ref_t const& v, K const& key,
+                                  copy_t& copy) const {
+        if (!v) {
+            return {};
+        }
+        std::pair<ref_t, ref_t> result;
+        if (less(key, key_of(get(v)))) {
+            auto [left, right] = split(v->left, key, copy);
+            result = {std::move(left),
+                      Nodes::make(std::move(right), v->right, v->entry,
+                                  v->priority, copy)};
+        } else {
+            auto [left, right] = split(v->right, key, copy);
+            result = {Nodes::make(v->left, std::move(left), v->entry,
+                                  v->priority, copy),
+                      std::move(right)};
+        }
+        Nodes::retire(get(v), copy);
+        return result;
+    }
+
+    ref_t merge(ref_t const& a, ref_t const& b, copy_t& copy) const {
+        if (!a) {
+            return b;
+        }
+        if (!b) {
+            return a;
+        }
+        if (a->priority >= b->priority) {
+            ref_t result = Nodes::make(a->left, merge(a->right, b, copy),
+                                       a->entry, a->priority, copy);
+            Nodes::retire(get(a), copy);
+            return result;
+        }
+        ref_t result = Nodes::make(merge(a, b->left, copy), b->right,
+                                   b->entry, b->priority, copy);
+        Nodes::retire(get(b), copy);
+        return result;
+    }
+};
+} // namespace details
@@ -0,0 +1,234 @@
+#pragma once
+
+#include "bimap.h"
+#include "parallel.h"
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// bimap split into shards by a hash of the left key, each behind its own
+// lock, so writers to different shards run in parallel. A right key is
+// found through a routing index, itself striped by a hash of the right
+// key, that names the shard holding it. A writer locks the stripe of its
+// right key and then the shard of its left key, which keeps both sides
+// unique across shards. Lookups return copies, as a reference would
+// outlive the lock. Every shard and stripe gets its own allocator, made by
+// select_on_container_copy_construction, so a stateful allocator such as
+// pool_allocator is never used by two locks at once
+template <typename Left, typename Right, typename CompareLeft = std::less<Left>,
+          typename CompareRight = std::less<Right>,
+          typename HashLeft = std::hash<Left>,
+          typename HashRight = std::hash<Right>,
+          typename Allocator = std::allocator<std::pair<Left, Right>>,
+          typename Policy = default_bimap_policy>
+struct sharded_bimap {
+    using left_t = Left;
+    using right_t = Right;
+    using cmp_left_t = CompareLeft;
+    using cmp_right_t = CompareRight;
+    using allocator_type = Allocator;
+    using bimap_t =
+        bimap<Left, Right, CompareLeft, CompareRight, Allocator, Policy>;
+
+    explicit sharded_bimap(std::size_t shards = details::default_threads(),
+                           CompareLeft compare_left = CompareLeft(),
+                           CompareRight compare_right = CompareRight(),
+                           HashLeft hash_left = HashLeft(),
+                           HashRight hash_right = HashRight(),
+                           Allocator const& alloc = Allocator())
+        : shard_count(shards == 0 ? 1 : shards),
+          shard_list(new shard[shard_count]),
+          stripe_list(new stripe[shard_count]),
+          hash_left(std::move(hash_left)), hash_right(std::move(hash_right)) {
+        for (std::size_t i = 0; i < shard_count; i++) {
+            shard_list[i].map =
+                bimap_t(compare_left, compare_right, own_allocator(alloc));
+            stripe_list[i].routes = routes_t(
+                compare_right, route_allocator_t(own_allocator(alloc)));
+        }
+    }
+
+    sharded_bimap(sharded_bimap const&) = delete;
+    sharded_bimap& operator=(sharded_bimap const&) = delete;
+
+    bool insert(left_t left, right_t right) {
+        stripe& st = stripe_of(right);
+        std::lock_guard<std::mutex> route_lock(st.lock);
+        if (st.routes.count(right) != 0) {
+            return false;
+        }
+        std::size_t index = shard_index(left);
+        shard& sh = shard_list[index];
+        std::lock_guard<std::mutex> shard_lock(sh.lock);
+        if (sh.map.find_left(left) != sh.map.end_left()) {
+            return false;
+        }
+        auto route = st.routes.emplace(right, index).first;
+        try {
+            sh.map.insert(std::move(left), std::move(right));
+        } catch (...) {
+            st.routes.erase(route);
+            throw;
+        }
+        return true;
+    }
+
+    bool erase_left(left_t const& left) {
+        shard& sh = shard_of(left);
+        for (;;) {
+            std::optional<right_t> right = find_left(left);
+            if (!right) {
+                return false;
+            }
+            stripe& st = stripe_of(*right);
+            std::lock_guard<std::mutex> route_lock(st.lock);
+            std::lock_guard<std::mutex> shard_lock(sh.lock);
+            // the pair may have changed while no lock was held
+            auto it = sh.map.find_left(left);
+            if (it == sh.map.end_left()) {
+                return false;
+            }
+            if (compare_right()(*it.flip(), *right) ||
+                compare_right()(*right, *it.flip())) {
+                continue;
+            }
+            st.routes.erase(*right);
+            sh.map.erase_left(it);
+            return true;
+        }
+    }
+
+    bool erase_right(right_t const& right) {
+        stripe& st = stripe_of(right);
+        std::lock_guard<std::mutex> route_lock(st.lock);
+        auto route = st.routes.find(right);
+        if (route == st.routes.end()) {
+            return false;
+        }
+        shard& sh = shard_list[route->second];
+        std::lock_guard<std::mutex> shard_lock(sh.lock);
+        sh.map.erase_right(right);
+        st.routes.erase(route);
+        return true;
+    }
+
+    std::optional<right_t> find_left(left_t const& left) const {
+        shard& sh = shard_of(left);
+        std::lock_guard<std::mutex> lock(sh.lock);
+        auto it = sh.map.find_left(left);
+        if (it == sh.map.end_left()) {
+            return std::nullopt;
+        }
+        return *it.flip();
+    }
+
+    std::optional<left_t> find_right(right_t const& right) const {
+        stripe& st = stripe_of(right);
+        std::lock_guard<std::mutex> route_lock(st.lock);
+        auto route = st.routes.find(right);
+        if (route == st.routes.end()) {
+            return std::nullopt;
+        }
+        shard& sh = shard_list[route->second];
+        std::lock_guard<std::mutex> shard_lock(sh.lock);
+        return *sh.map.find_right(right).flip();
+    }
+
+    right_t at_left(left_t const& key) const {
+        std::optional<right_t> found = find_left(key);
+        if (!found) {
+            throw std::out_of_range("there is no such value in bimap");
+        }
+        return std::move(*found);
+    }
+
+    left_t at_right(right_t const& key) const {
+        std::optional<left_t> found = find_right(key);
+        if (!found) {
+            throw std::out_of_range("there is no such value in bimap");
+        }
+        return std::move(*found);
+    }
+
+    // exact only while no writer runs
+    std::size_t size() const {
+        std::size_t result = 0;
+        for (std::size_t i = 0; i < shard_count; i++) {
+            std::lock_guard<std::mutex> lock(shard_list[i].lock);
+            result += shard_list[i].map.size();
+        }
+        return result;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    std::size_t shards() const noexcept {
+        return shard_count;
+    }
+
+    // the pairs of every shard in one bimap; takes all shard locks
+    bimap_t collect() const {
+        std::vector<std::unique_lock<std::mutex>> locks;
+        for (std::size_t i = 0; i < shard_count; i++) {
+            locks.emplace_back(shard_list[i].lock);
+        }
+        bimap_t result(shard_list[0].map);
+        for (std::size_t i = 1; i < shard_count; i++) {
+            result.merge(bimap_t(shard_list[i].map), 1);
+        }
+        return result;
+    }
+
+  private:
+    using route_allocator_t =
+        typename std::allocator_traits<Allocator>::template rebind_alloc<
+            std::pair<right_t const, std::size_t>>;
+    using routes_t =
+        std::map<right_t, std::size_t, cmp_right_t, route_allocator_t>;
+
+    // padded so that neighbouring locks do not share a cache line
+    struct alignas(64) shard {
+        std::mutex lock;
+        bimap_t map;
+    };
+
+    struct alignas(64) stripe {
+        std::mutex lock;
+        routes_t routes;
+    };
+
+    static Allocator own_allocator(Allocator const& alloc) {
+        return std::allocator_traits<
+            Allocator>::select_on_container_copy_construction(alloc);
+    }
+
+    std::size_t shard_index(left_t const& left) const {
+        return hash_left(left) % shard_count;
+    }
+
+    shard& shard_of(left_t const& left) const {
+        return shard_list[shard_index(left)];
+    }
+
+    stripe& stripe_of(right_t const& right) const {
+        return stripe_list[hash_right(right) % shard_count];
+    }
+
+    cmp_right_t compare_right() const {
+        return stripe_list[0].routes.key_comp();
+    }
+
+    std::size_t shard_count;
+    std::unique_ptr<shard[]> shard_list;
+    std::unique_ptr<stripe[]> stripe_list;
+    HashLeft hash_left;
+    HashRight hash_right;
+};
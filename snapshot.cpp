@@ -0,0 +1,156 @@
+#include "snapshot.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+void details::snapshot_checksum::update(void const* data,
+                                        std::size_t size) noexcept {
+    auto const* bytes = static_cast<unsigned char const*>(data);
+    total += size;
+    while (size != 0 && pending_bytes != 0) {
+        pending |= uint64_t(*bytes++) << (8 * pending_bytes);
+        size--;
+        if (++pending_bytes == 8) {
+            mix(pending);
+            pending = 0;
+            pending_bytes = 0;
+        }
+    }
+    for (; size >= 8; bytes += 8, size -= 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes, 8);
+        mix(word);
+    }
+    for (; size != 0; size--) {
+        pending |= uint64_t(*bytes++) << (8 * pending_bytes++);
+    }
+}
+
+uint64_t details::snapshot_checksum::value() const noexcept {
+    snapshot_checksum copy = *this;
+    copy.mix(copy.pending);
+    copy.mix(total);
+    uint64_t x = copy.state;
+    x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdULL;
+    return x ^ (x >> 33);
+}
+
+void details::snapshot_checksum::mix(uint64_t word) noexcept {
+    state = (state ^ word) * 0x100000001b3ULL;
+    state ^= state >> 29;
+}
+
+namespace {
+std::size_t aligned(std::size_t offset) noexcept {
+    std::size_t step = details::snapshot_header::section_alignment;
+    return (offset + step - 1) / step * step;
+}
+} // namespace
+
+details::snapshot_layout::snapshot_layout(std::size_t left_size,
+                                          std::size_t right_size,
+                                          std::size_t count) noexcept
+    : count(count), lefts(aligned(sizeof(snapshot_header))),
+      rights(aligned(lefts + count * left_size)),
+      left_partners(aligned(rights + count * right_size)),
+      right_partners(aligned(left_partners + count * sizeof(uint64_t))),
+      end(right_partners + count * sizeof(uint64_t)) {}
+
+details::snapshot_layout
+details::check_snapshot_header(char const* file, std::size_t size,
+                               std::size_t left_size, std::size_t right_size) {
+    snapshot_header header;
+    if (size < sizeof(header)) {
+        throw snapshot_error("snapshot is truncated");
+    }
+    std::memcpy(&header, file, sizeof(header));
+    if (std::memcmp(header.magic, snapshot_header::expected_magic,
+                    sizeof(header.magic)) != 0) {
+        throw snapshot_error("not a bimap snapshot");
+    }
+    if (header.byte_order != snapshot_header::host_byte_order) {
+        throw snapshot_error("snapshot has a different byte order");
+    }
+    if (header.version != snapshot_header::current_version) {
+        throw snapshot_error("unsupported snapshot version " +
+                             std::to_string(header.version));
+    }
+    if (header.left_size != left_size || header.right_size != right_size) {
+        throw snapshot_error("snapshot holds keys of other sizes");
+    }
+    // bounds count first, so that the layout cannot overflow
+    std::size_t per_pair = left_size + right_size + 2 * sizeof(uint64_t);
+    if (header.count > size / per_pair ||
+        snapshot_layout(left_size, right_size, header.count).end != size) {
+        throw snapshot_error("snapshot is truncated or has trailing data");
+    }
+    return snapshot_layout(left_size, right_size, header.count);
+}
+
+void details::check_snapshot_checksum(char const* file,
+                                      snapshot_layout const& layout) {
+    snapshot_header header;
+    std::memcpy(&header, file, sizeof(header));
+    snapshot_checksum checksum;
+    checksum.update(file + sizeof(header), layout.end - sizeof(header));
+    if (checksum.value() != header.checksum) {
+        throw snapshot_error("snapshot checksum mismatch");
+    }
+}
+
+void details::write_all(int fd, void const* data, std::size_t size) {
+    auto const* bytes = static_cast<char const*>(data);
+    while (size != 0) {
+        ssize_t written = ::write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(),
+                                    "cannot write bimap snapshot");
+        }
+        bytes += written;
+        size -= static_cast<std::size_t>(written);
+    }
+}
+
+details::mapped_file::mapped_file(std::string const& path, access pattern) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(),
+                                "cannot open " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(),
+                                "cannot stat " + path);
+    }
+    length = static_cast<std::size_t>(st.st_size);
+    if (length != 0) {
+        address = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(),
+                                    "cannot map " + path);
+        }
+        // a load reads the file front to back once, while lookups in
+        // place touch a few pages each and gain nothing from read-ahead
+        ::madvise(address, length,
+                  pattern == access::sequential ? MADV_SEQUENTIAL
+                                                : MADV_RANDOM);
+    }
+    ::close(fd);
+}
+
+details::mapped_file::~mapped_file() {
+    if (address != nullptr) {
+        ::munmap(address, length);
+    }
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+struct snapshot_error : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+namespace details {
+
+// a snapshot file is this header followed by four sections: the left keys
+// in left order, the right keys in right order, for every left position
+// the right position of its pair and for every right position the left
+// position of its pair, the last two as uint64_t. Every section starts at
+// a multiple of section_alignment, so a mapping of the file can be read
+// in place. All in host byte order, checked by byte_order
+struct snapshot_header {
+    static constexpr char expected_magic[8] = {'B', 'I', 'M', 'A',
+                                               'P', 'S', 'N', 'P'};
+    static constexpr uint32_t current_version = 2;
+    static constexpr uint32_t host_byte_order = 0x01020304;
+    static constexpr std::size_t section_alignment = 64;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t left_size;
+    uint32_t right_size;
+    uint64_t count;
+    uint64_t checksum;
+};
+
+// offsets of the sections from the start of the file
+struct snapshot_layout {
+    snapshot_layout(std::size_t left_size, std::size_t right_size,
+                    std::size_t count) noexcept;
+
+    std::size_t count;
+    std::size_t lefts;
+    std::size_t rights;
+    std::size_t left_partners;
+    std::size_t right_partners;
+    std::size_t end;
+};
+
+// 64-bit checksum of everything after the header, fed in any chunking
+struct snapshot_checksum {
+    void update(void const* data, std::size_t size) noexcept;
+
+    uint64_t value() const noexcept;
+
+  private:
+    void mix(uint64_t word) noexcept;
+
+    uint64_t state{0x9e3779b97f4a7c15ULL};
+    uint64_t pending{0};
+    std::size_t pending_bytes{0};
+    uint64_t total{0};
+};
+
+// the layout a file of size bytes has, or throws if it is not a snapshot
+// of pairs of these sizes
+snapshot_layout check_snapshot_header(char const* file, std::size_t size,
+                                      std::size_t left_size,
+                                      std::size_t right_size);
+
+void check_snapshot_checksum(char const* file, snapshot_layout const& layout);
+
+template <typename K>
+K read_flat(char const* bytes) noexcept {
+    alignas(K) unsigned char storage[sizeof(K)];
+    std::memcpy(storage, bytes, sizeof(K));
+    return *std::launder(reinterpret_cast<K*>(storage));
+}
+
+template <typename K, typename Compare>
+bool keys_increasing(char const* keys, std::size_t n,
+                     Compare const& compare) {
+    for (std::size_t i = 1; i < n; i++) {
+        if (!compare(read_flat<K>(keys + (i - 1) * sizeof(K)),
+                     read_flat<K>(keys + i * sizeof(K)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the checksum cannot tell a file saved with other comparators, nor a
+// crafted one; O(n) and reads the file through memcpy, so it may be
+// unaligned
+template <typename Left, typename Right, typename CompareLeft,
+          typename CompareRight>
+void check_snapshot_order(char const* file, snapshot_layout const& layout,
+                          CompareLeft const& compare_left,
+                          CompareRight const& compare_right) {
+    std::size_t n = layout.count;
+    char const* left_partners = file + layout.left_partners;
+    char const* right_partners = file + layout.right_partners;
+    for (std::size_t i = 0; i < n; i++) {
+        uint64_t j = read_flat<uint64_t>(left_partners + i * sizeof(uint64_t));
+        if (j >= n ||
+            read_flat<uint64_t>(right_partners + j * sizeof(uint64_t)) != i) {
+            throw snapshot_error("snapshot pairs are inconsistent");
+        }
+    }
+    if (!keys_increasing<Left>(file + layout.lefts, n, compare_left) ||
+        !keys_increasing<Right>(file + layout.rights, n, compare_right)) {
+        throw snapshot_error("snapshot keys are out of order");
+    }
+}
+
+void write_all(int fd, void const* data, std::size_t size);
+
+// read-only private mapping of a whole file
+struct mapped_file {
+    enum class access { sequential, random };
+
+    explicit mapped_file(std::string const& path,
+                         access pattern = access::sequential);
+    mapped_file(mapped_file const&) = delete;
+    mapped_file& operator=(mapped_file const&) = delete;
+    ~mapped_file();
+
+    char const* data() const noexcept {
+        return static_cast<char const*>(address);
+    }
+
+    std::size_t size() const noexcept {
+        return length;
+    }
+
+  private:
+    void* address{nullptr};
+    std::size_t length{0};
+};
+} // namespace details
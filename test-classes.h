@@ -51,3 +51,74 @@ private:
   int a;
 };
 
+
+struct allocation_counter {
+  static inline size_t allocations = 0;
+  static inline size_t deallocations = 0;
+};
+
+template <typename T>
+struct counting_allocator : allocation_counter {
+  using value_type = T;
+
+  counting_allocator() = default;
+  template <typename U>
+  counting_allocator(counting_allocator<U> const &) {}
+
+  T *allocate(size_t n) {
+    allocations++;
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T *p, size_t n) {
+    deallocations++;
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template <typename U>
+  bool operator==(counting_allocator<U> const &) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(counting_allocator<U> const &) const {
+    return false;
+  }
+};
+
+struct three_way_compare {
+  struct ordering {
+    int value;
+    friend bool operator<(ordering x, int zero) { return x.value < zero; }
+    friend bool operator==(ordering x, int zero) { return x.value == zero; }
+  };
+
+  static inline size_t calls = 0;
+
+  ordering operator()(int a, int b) const {
+    calls++;
+    return {a < b ? -1 : (a == b ? 0 : 1)};
+  }
+};
+
+struct object_int_compare {
+  using is_transparent = void;
+
+  bool operator()(test_object const &x, test_object const &y) const {
+    return x.a < y.a;
+  }
+  bool operator()(test_object const &x, int y) const { return x.a < y; }
+  bool operator()(int x, test_object const &y) const { return x < y.a; }
+};
+
+// compare() orders the keys the other way round from operator<
+struct reversed_compare_member {
+  int a = 0;
+  explicit reversed_compare_member(int b) : a(b) {}
+  int compare(reversed_compare_member const &other) const {
+    return other.a - a;
+  }
+  friend bool operator<(reversed_compare_member const &c,
+                        reversed_compare_member const &b) {
+    return c.a < b.a;
+  }
+};
@@ -1,6 +1,19 @@
+#include <fcntl.h>
+#include <map>
+#include <numeric>
 #include <random>
+#include <set>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
 
 #include "bimap.h"
+#include "concurrent_bimap.h"
+#include "frozen_bimap.h"
+#include "node_pool.h"
+#include "persistent_bimap.h"
+#include "sharded_bimap.h"
 #include "test-classes.h"
 #include "gtest/gtest.h"
 
@@ -54,6 +67,92 @@ TEST(bimap, custom_parametrized_comparator) {
   }
 }
 
+TEST(bimap, three_way_comparator) {
+  bimap<int, int, three_way_compare, std::greater<>> b;
+  for (int i = 0; i < 100; i++) {
+    b.insert(i, i);
+  }
+  std::vector<int> lefts(b.begin_left(), b.end_left());
+  std::vector<int> rights(b.begin_right(), b.end_right());
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(lefts[i], i);
+    EXPECT_EQ(rights[i], 99 - i);
+  }
+  // one comparison per level, the root being at depth 1
+  size_t depth = b.analyze().left.depths.size();
+  for (int key : {0, 42, 99, 1000, -1}) {
+    three_way_compare::calls = 0;
+    b.find_left(key);
+    EXPECT_LE(three_way_compare::calls, depth);
+    three_way_compare::calls = 0;
+    b.lower_bound_left(key);
+    EXPECT_LE(three_way_compare::calls, depth);
+  }
+  EXPECT_EQ(b.at_left(42), 42);
+  EXPECT_EQ(*b.lower_bound_left(50), 50);
+  EXPECT_EQ(b.find_left(1000), b.end_left());
+  EXPECT_FALSE(b.insert(5, 1000) != b.end_left());
+}
+
+TEST(bimap, string_three_way) {
+  bimap<std::string, std::string, std::less<std::string>,
+        std::greater<std::string>>
+      b;
+  b.insert("b", "x");
+  b.insert("a", "y");
+  b.insert("c", "z");
+  EXPECT_EQ(*b.begin_left(), "a");
+  EXPECT_EQ(*b.begin_right(), "z");
+  EXPECT_EQ(b.at_left("b"), "x");
+  EXPECT_EQ(b.at_right("y"), "a");
+  EXPECT_EQ(b.find_right("w"), b.end_right());
+  EXPECT_EQ(*b.lower_bound_right("yy"), "y");
+  EXPECT_EQ(b.insert("d", "x"), b.end_left());
+}
+
+TEST(bimap, compare_member_ignored) {
+  bimap<reversed_compare_member, int> b;
+  for (int i = 0; i < 50; i++) {
+    b.insert(reversed_compare_member((i * 37) % 50), i);
+  }
+  EXPECT_TRUE(b.analyze().valid());
+  for (int i = 0; i < 50; i++) {
+    EXPECT_EQ(b.at_left(reversed_compare_member((i * 37) % 50)), i);
+  }
+  EXPECT_EQ(b.begin_left()->a, 0);
+}
+
+TEST(bimap, transparent_lookup) {
+  bimap<std::string, std::string, std::less<>, std::less<>> b;
+  b.insert("one", "1");
+  b.insert("two", "2");
+  b.insert("three", "3");
+  std::string_view key = "two";
+  EXPECT_EQ(b.at_left(key), "2");
+  EXPECT_EQ(*b.find_right(std::string_view("3")).flip(), "three");
+  EXPECT_EQ(b.find_left(std::string_view("four")), b.end_left());
+  EXPECT_EQ(*b.lower_bound_left(std::string_view("p")), "three");
+  EXPECT_EQ(*b.upper_bound_right(std::string_view("2")), "3");
+  EXPECT_THROW(b.at_right(std::string_view("4")), std::out_of_range);
+  EXPECT_TRUE(b.erase_right(std::string_view("1")));
+  EXPECT_FALSE(b.erase_left(std::string_view("one")));
+  EXPECT_EQ(b.size(), 2);
+}
+
+TEST(bimap, transparent_comparator) {
+  bimap<test_object, int, object_int_compare> b;
+  b.insert(test_object(3), 30);
+  b.insert(test_object(1), 10);
+  b.insert(test_object(2), 20);
+  EXPECT_EQ(b.at_left(2), 20);
+  EXPECT_EQ(b.find_left(5), b.end_left());
+  EXPECT_EQ(b.lower_bound_left(2)->a, 2);
+  EXPECT_EQ(b.upper_bound_left(2)->a, 3);
+  EXPECT_TRUE(b.erase_left(1));
+  EXPECT_EQ(b.at_right(30).a, 3);
+  EXPECT_EQ(b.size(), 2);
+}
+
 TEST(bimap, copies) {
   bimap<int, int> b;
   b.insert(3, 4);
@@ -243,6 +342,21 @@ TEST(bimap, erase_range) {
   EXPECT_TRUE(b.empty());
 }
 
+TEST(bimap, clear) {
+  bimap<int, std::string> b;
+  for (int i = 0; i < 1000; i++) {
+    b.insert(i, std::to_string(i));
+  }
+  b.clear();
+  EXPECT_TRUE(b.empty());
+  EXPECT_EQ(b.begin_left(), b.end_left());
+  EXPECT_EQ(b.begin_right(), b.end_right());
+  EXPECT_EQ(b.find_right("10"), b.end_right());
+  b.insert(1, "1");
+  EXPECT_EQ(b.at_right("1"), 1);
+  EXPECT_EQ(b.size(), 1);
+}
+
 TEST(bimap, lower_bound) {
   bimap<int, int> b;
 
@@ -366,6 +480,1058 @@ TEST(bimap, swap) {
   EXPECT_EQ(*b.find_right(3), 3);
 }
 
+TEST(bimap, allocator) {
+  using alloc = counting_allocator<std::pair<int, int>>;
+  size_t allocated = alloc::allocations;
+  size_t deallocated = alloc::deallocations;
+  {
+    bimap<int, int, std::less<int>, std::less<int>, alloc> b;
+    EXPECT_EQ(alloc::allocations, allocated);
+    for (int i = 0; i < 100; i++) {
+      b.insert(i, -i);
+    }
+    b.insert(5, 1000);
+    EXPECT_EQ(alloc::allocations, allocated + 100);
+    b.erase_left(10);
+    EXPECT_EQ(alloc::deallocations, deallocated + 1);
+  }
+  EXPECT_EQ(alloc::deallocations, deallocated + 100);
+}
+
+TEST(bimap, rejected_insert_keeps_arguments) {
+  bimap<std::string, std::string> b;
+  b.insert("a", "x");
+  std::string left = "a";
+  std::string right = "y";
+  EXPECT_EQ(b.insert(std::move(left), std::move(right)), b.end_left());
+  EXPECT_EQ(left, "a");
+  EXPECT_EQ(right, "y");
+  left = "b";
+  right = "x";
+  EXPECT_EQ(b.insert(std::move(left), std::move(right)), b.end_left());
+  EXPECT_EQ(left, "b");
+  EXPECT_EQ(right, "x");
+  EXPECT_EQ(b.size(), 1);
+}
+
+TEST(bimap, pool_allocator) {
+  using map_t = bimap<int, std::string, std::less<int>, std::less<std::string>,
+                      pool_allocator<std::pair<int, std::string>>>;
+  map_t b;
+  for (int i = 0; i < 1000; i++) {
+    b.insert(i, std::to_string(i * 2));
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    EXPECT_TRUE(b.erase_left(i));
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    b.insert(i, std::to_string(-i - 1));
+  }
+  EXPECT_EQ(b.size(), 1000);
+  map_t c = std::move(b);
+  EXPECT_EQ(c.size(), 1000);
+  EXPECT_TRUE(b.empty());
+  EXPECT_EQ(c.at_right("-5"), 4);
+  b.insert(1, "1");
+  EXPECT_EQ(b.size(), 1);
+  map_t d(c);
+  EXPECT_EQ(c, d);
+  EXPECT_NE(c.get_allocator(), d.get_allocator());
+}
+
+TEST(bimap, from_sorted) {
+  std::vector<std::pair<int, int>> data;
+  for (int i = 0; i < 1000; i++) {
+    data.push_back({i * 2, (i * 7919) % 1000});
+  }
+  auto b = bimap<int, int>::from_sorted(data);
+  bimap<int, int> expected;
+  for (auto const &p : data) {
+    expected.insert(p.first, p.second);
+  }
+  EXPECT_EQ(b.size(), 1000);
+  EXPECT_EQ(b, expected);
+  EXPECT_EQ(b.at_right(7), expected.at_right(7));
+
+  for (int i = 0; i < 1000; i += 3) {
+    EXPECT_TRUE(b.erase_left(i * 2));
+    expected.erase_left(i * 2);
+  }
+  b.insert(1, 5000);
+  expected.insert(1, 5000);
+  EXPECT_EQ(b, expected);
+}
+
+TEST(bimap, assign_sorted_duplicates) {
+  std::vector<std::pair<int, int>> data = {
+      {1, 10}, {1, 20}, {2, 10}, {3, 30}, {4, 40}, {4, 41}};
+  bimap<int, int> b;
+  b.insert(100, 100);
+  b.assign_sorted(data.begin(), data.end());
+  EXPECT_EQ(b.size(), 3);
+  EXPECT_EQ(b.at_left(1), 10);
+  EXPECT_EQ(b.at_left(3), 30);
+  EXPECT_EQ(b.at_left(4), 40);
+  EXPECT_EQ(b.find_left(100), b.end_left());
+
+  std::vector<std::pair<int, int>> unsorted = {{5, 1}, {3, 2}, {4, 3}, {3, 4}};
+  b.assign_sorted(unsorted);
+  EXPECT_EQ(b.size(), 3);
+  std::vector<int> lefts(b.begin_left(), b.end_left());
+  EXPECT_EQ(lefts, std::vector<int>({3, 4, 5}));
+  EXPECT_EQ(b.at_left(3), 2);
+}
+
+template <typename Policy>
+void check_policy() {
+  using map_t = bimap<int, std::string, std::less<int>, std::less<std::string>,
+                      std::allocator<std::pair<int, std::string>>, Policy>;
+  map_t b;
+  std::map<int, std::string> expected;
+  std::mt19937 e(42);
+  for (int i = 0; i < 5000; i++) {
+    int key = e() % 1000;
+    if (e() % 3 == 0) {
+      if (expected.erase(key) == 1) {
+        EXPECT_TRUE(b.erase_left(key));
+      }
+    } else if (b.find_right(std::to_string(key)) == b.end_right() &&
+               expected.insert({key, std::to_string(key)}).second) {
+      b.insert(key, std::to_string(key));
+    }
+  }
+  EXPECT_EQ(b.size(), expected.size());
+  auto it = b.begin_left();
+  for (auto const &p : expected) {
+    EXPECT_EQ(*it, p.first);
+    EXPECT_EQ(*it.flip(), p.second);
+    EXPECT_EQ(it.flip().flip(), it);
+    it++;
+  }
+  EXPECT_EQ(it, b.end_left());
+  for (auto rit = expected.rbegin(); rit != expected.rend(); rit++) {
+    EXPECT_EQ(*--it, rit->first);
+  }
+  EXPECT_EQ(b.end_left().flip(), b.end_right());
+  EXPECT_EQ(*b.lower_bound_left(500), expected.lower_bound(500)->first);
+  EXPECT_EQ(*b.upper_bound_left(500), expected.upper_bound(500)->first);
+
+  map_t copy(b);
+  EXPECT_EQ(copy, b);
+  auto first = copy.lower_bound_left(100);
+  auto last = copy.upper_bound_left(900);
+  EXPECT_EQ(copy.erase_left(first, last), last);
+  EXPECT_EQ(copy.size(),
+            std::distance(expected.begin(), expected.lower_bound(100)) +
+                std::distance(expected.upper_bound(900), expected.end()));
+  map_t moved(std::move(copy));
+  copy.swap(moved);
+  EXPECT_EQ(*copy.begin_right(),
+            *std::min_element(copy.begin_right(), copy.end_right()));
+}
+
+TEST(bimap, hashed_priorities) {
+  check_policy<address_hashed_bimap_policy>();
+  check_policy<key_hashed_bimap_policy>();
+  EXPECT_LT(sizeof(bimap<long, long, std::less<long>, std::less<long>,
+                         std::allocator<std::pair<long, long>>,
+                         address_hashed_bimap_policy>::node_t),
+            sizeof(bimap<long, long>::node_t));
+}
+
+struct compact_hashed_policy : compact_bimap_policy {
+  using priority = details::address_hashed_priority;
+};
+
+TEST(bimap, compact_layout) {
+  check_policy<default_bimap_policy>();
+  check_policy<compact_bimap_policy>();
+  check_policy<compact_hashed_policy>();
+  EXPECT_EQ(sizeof(bimap<long, long, std::less<long>, std::less<long>,
+                         std::allocator<std::pair<long, long>>,
+                         compact_hashed_policy>::node_t),
+            6 * sizeof(long));
+}
+
+template <typename Policy>
+void check_iterators_after_move() {
+  using map_t = bimap<int, int, std::less<int>, std::less<int>,
+                      std::allocator<std::pair<int, int>>, Policy>;
+  auto b = std::make_unique<map_t>();
+  for (int i = 0; i < 100; i++) {
+    b->insert(i, -i);
+  }
+  auto it = b->find_left(98);
+  auto rit = b->find_right(-1);
+  map_t moved(std::move(*b));
+  b.reset();
+  EXPECT_EQ(*it.flip(), -98);
+  EXPECT_EQ(*++it, 99);
+  EXPECT_EQ(++it, moved.end_left());
+  EXPECT_EQ(*--it, 99);
+
+  map_t other;
+  other.insert(1000, 1000);
+  auto other_it = other.begin_left();
+  other.swap(moved);
+  EXPECT_EQ(*++rit, 0);
+  EXPECT_EQ(++rit, other.end_right());
+  EXPECT_EQ(++other_it, moved.end_left());
+  EXPECT_EQ(*other.begin_left(), 0);
+  other.erase_left(it);
+  EXPECT_EQ(*--other.end_left(), 98);
+}
+
+template <typename Policy>
+void check_order_statistics() {
+  using map_t = bimap<int, int, std::less<int>, std::less<int>,
+                      std::allocator<std::pair<int, int>>, Policy>;
+  map_t b;
+  std::set<int> lefts, rights;
+  std::mt19937 e(7);
+  for (int i = 0; i < 3000; i++) {
+    int key = e() % 500;
+    if (e() % 3 == 0) {
+      if (b.erase_left(key)) {
+        lefts.erase(key);
+        rights.erase(-2 * key);
+      }
+    } else if (b.insert(key, -2 * key) != b.end_left()) {
+      lefts.insert(key);
+      rights.insert(-2 * key);
+    }
+  }
+  map_t copy(b);
+  copy.erase_left(copy.lower_bound_left(100), copy.upper_bound_left(200));
+  for (auto it = lefts.begin(); it != lefts.end();) {
+    it = (*it >= 100 && *it <= 200 ? lefts.erase(it) : std::next(it));
+  }
+  rights.clear();
+  for (int x : lefts) {
+    rights.insert(-2 * x);
+  }
+
+  ASSERT_EQ(copy.size(), lefts.size());
+  std::vector<int> left_keys(lefts.begin(), lefts.end());
+  std::vector<int> right_keys(rights.begin(), rights.end());
+  for (size_t k = 0; k < left_keys.size(); k++) {
+    EXPECT_EQ(*copy.nth_left(k), left_keys[k]);
+    EXPECT_EQ(*copy.nth_right(k), right_keys[k]);
+    EXPECT_EQ(copy.rank_left(left_keys[k]), k);
+    EXPECT_EQ(copy.rank_right(right_keys[k] + 1), k + 1);
+    EXPECT_EQ(copy.nth_left(k) - copy.begin_left(), k);
+    EXPECT_EQ(copy.begin_right() + k, copy.nth_right(k));
+  }
+  EXPECT_EQ(copy.nth_left(copy.size()), copy.end_left());
+  EXPECT_EQ(copy.end_left() - copy.begin_left(), copy.size());
+  EXPECT_EQ(copy.end_right() - 1, std::prev(copy.end_right()));
+  auto it = copy.begin_left();
+  it += 10;
+  it -= 3;
+  EXPECT_EQ(*it, left_keys[7]);
+}
+
+struct compact_ranked_policy : compact_bimap_policy {
+  using augmentation = details::subtree_size;
+};
+
+TEST(bimap, order_statistics) {
+  check_policy<order_statistics_bimap_policy>();
+  check_policy<compact_ranked_policy>();
+  check_order_statistics<order_statistics_bimap_policy>();
+  check_order_statistics<compact_ranked_policy>();
+}
+
+TEST(bimap, iterators_survive_move) {
+  check_iterators_after_move<default_bimap_policy>();
+  check_iterators_after_move<compact_bimap_policy>();
+  check_iterators_after_move<compact_ranked_policy>();
+}
+
+TEST(bimap, emplace) {
+  bimap<std::string, std::string> b;
+  EXPECT_EQ(*b.emplace(std::piecewise_construct, std::forward_as_tuple(3, 'a'),
+                       std::forward_as_tuple("xyz", 2)),
+            "aaa");
+  EXPECT_EQ(b.at_left("aaa"), "xy");
+  EXPECT_EQ(*b.emplace_right("b", "c"), "c");
+  EXPECT_EQ(b.emplace_left("aaa", "d"), b.end_left());
+  EXPECT_EQ(b.emplace_right("e", "xy"), b.end_right());
+  EXPECT_EQ(b.size(), 2);
+
+  using alloc = counting_allocator<std::pair<int, int>>;
+  size_t deallocated = alloc::deallocations;
+  {
+    bimap<int, int, std::less<int>, std::less<int>, alloc> c;
+    c.emplace(1, 2);
+    c.emplace(1, 3);
+    EXPECT_EQ(alloc::deallocations, deallocated + 1);
+  }
+  EXPECT_EQ(alloc::deallocations, deallocated + 2);
+}
+
+template <typename Policy>
+void check_hinted_insert() {
+  using map_t = bimap<int, int, std::less<int>, std::less<int>,
+                      std::allocator<std::pair<int, int>>, Policy>;
+  map_t b;
+  std::map<int, int> expected;
+  for (int i = 0; i < 1000; i++) {
+    b.insert(b.end_left(), 2 * i, -i);
+    expected.insert({2 * i, -i});
+  }
+  auto hint = b.begin_left();
+  for (int i = 0; i < 1000; i += 3) {
+    hint = b.insert(hint, 2 * i + 1, 5000 + i);
+    EXPECT_EQ(*hint, 2 * i + 1);
+    expected.insert({2 * i + 1, 5000 + i});
+  }
+  std::mt19937 e(3);
+  for (int i = 0; i < 1000; i++) {
+    int key = e() % 3000;
+    auto it = b.insert(b.nth_left(e() % b.size()), key, key + 10000);
+    if (expected.insert({key, key + 10000}).second) {
+      EXPECT_EQ(*it, key);
+    } else {
+      EXPECT_EQ(it, b.end_left());
+    }
+  }
+  EXPECT_EQ(b.insert(b.begin_left(), 5001, 0), b.end_left());
+  ASSERT_EQ(b.size(), expected.size());
+  auto it = b.begin_left();
+  size_t index = 0;
+  for (auto const& p : expected) {
+    EXPECT_EQ(*it, p.first);
+    EXPECT_EQ(*it.flip(), p.second);
+    EXPECT_EQ(b.rank_left(p.first), index++);
+    it++;
+  }
+}
+
+TEST(bimap, hinted_insert) {
+  check_hinted_insert<order_statistics_bimap_policy>();
+  check_hinted_insert<compact_ranked_policy>();
+}
+
+TEST(bimap, hinted_append) {
+  using map_t = bimap<int, int, std::less<int>, std::less<int>,
+                      std::allocator<std::pair<int, int>>,
+                      instrumented_bimap_policy>;
+  map_t b;
+  for (int i = 0; i < 50000; i++) {
+    b.insert(b.end_left(), i, -i);
+  }
+  EXPECT_EQ(b.stats().left.hint_steps, 0);
+  auto hint = b.find_left(49999);
+  for (int i = 50000; i < 100000; i++) {
+    hint = b.insert(hint, i, -i);
+  }
+  EXPECT_EQ(b.stats().left.hint_steps, 0);
+  EXPECT_LE(b.stats().left.rotations, 300000);
+  ASSERT_EQ(b.size(), 100000);
+  EXPECT_TRUE(b.analyze().valid());
+
+  // an erase drops the cached tail, the next append finds it once
+  b.erase_left(99999);
+  b.insert(b.end_left(), 99999, -99999);
+  b.insert(b.end_left(), 100000, -100000);
+  EXPECT_LE(b.stats().left.hint_steps, b.stats().left.max_depth);
+  EXPECT_EQ(*std::prev(b.end_left()), 100000);
+  EXPECT_EQ(b.insert(b.end_left(), 7, 0), b.end_left());
+  EXPECT_EQ(b.insert(b.end_left(), 100001, -5), b.end_left());
+  EXPECT_TRUE(b.analyze().valid());
+}
+
+TEST(bimap, insert_rollback) {
+  using map_t = bimap<int, int, std::less<int>, std::less<int>,
+                      std::allocator<std::pair<int, int>>,
+                      order_statistics_bimap_policy>;
+  map_t b;
+  std::set<int> lefts, rights;
+  std::mt19937 e(11);
+  for (int i = 0; i < 5000; i++) {
+    int left = e() % 2000;
+    int right = e() % 2000;
+    bool fresh = !lefts.count(left) && !rights.count(right);
+    EXPECT_EQ(b.insert(left, right) != b.end_left(), fresh);
+    if (fresh) {
+      lefts.insert(left);
+      rights.insert(right);
+    }
+  }
+  ASSERT_EQ(b.size(), lefts.size());
+  size_t k = 0;
+  for (int x : lefts) {
+    EXPECT_EQ(*b.nth_left(k), x);
+    EXPECT_EQ(b.rank_left(x), k++);
+  }
+  k = 0;
+  for (int x : rights) {
+    EXPECT_EQ(*b.nth_right(k++), x);
+  }
+}
+
+template <typename Policy>
+void check_batches() {
+  using map_t = bimap<int, int, std::less<int>, std::less<int>,
+                      std::allocator<std::pair<int, int>>, Policy>;
+  map_t b;
+  std::map<int, int> expected;
+  std::set<int> rights;
+  std::mt19937 e(5);
+  for (int round = 0; round < 20; round++) {
+    std::vector<std::pair<int, int>> batch;
+    size_t inserted = 0;
+    for (int i = 0; i < 500; i++) {
+      std::pair<int, int> p(e() % 5000, e() % 5000);
+      batch.push_back(p);
+    }
+    std::set<int> batch_lefts, batch_rights;
+    std::vector<std::pair<int, int>> fresh_lefts;
+    for (auto const& p : batch) {
+      if (batch_lefts.insert(p.first).second && !expected.count(p.first)) {
+        fresh_lefts.push_back(p);
+      }
+    }
+    for (auto const& p : fresh_lefts) {
+      if (batch_rights.insert(p.second).second && !rights.count(p.second)) {
+        expected.insert(p);
+        inserted++;
+      }
+    }
+    for (auto const& p : expected) {
+      rights.insert(p.second);
+    }
+    EXPECT_EQ(b.insert_batch(batch), inserted);
+
+    std::vector<int> keys;
+    size_t erased = 0;
+    for (int i = 0; i < 200; i++) {
+      keys.push_back(e() % 5000);
+    }
+    for (int key : keys) {
+      auto it = expected.find(key);
+      if (it != expected.end()) {
+        rights.erase(it->second);
+        expected.erase(it);
+        erased++;
+      }
+    }
+    EXPECT_EQ(b.erase_batch(keys), erased);
+  }
+  ASSERT_EQ(b.size(), expected.size());
+  auto it = b.begin_left();
+  for (auto const& p : expected) {
+    EXPECT_EQ(*it, p.first);
+    EXPECT_EQ(*it.flip(), p.second);
+    EXPECT_EQ(b.find_right(p.second).flip(), it);
+    if constexpr (map_t::order_statistics) {
+      EXPECT_EQ(b.rank_left(p.first), it - b.begin_left());
+      EXPECT_EQ(b.nth_left(b.rank_left(p.first)), it);
+    }
+    it++;
+  }
+  std::vector<int> right_values(b.begin_right(), b.end_right());
+  EXPECT_EQ(right_values, std::vector<int>(rights.begin(), rights.end()));
+}
+
+TEST(bimap, batches) {
+  check_batches<default_bimap_policy>();
+  check_batches<compact_bimap_policy>();
+  check_batches<order_statistics_bimap_policy>();
+
+  // a right key shared within the batch goes to the earlier pair, as with
+  // one insert after another
+  bimap<int, int> b;
+  std::vector<std::pair<int, int>> batch{{2, 5}, {1, 5}};
+  EXPECT_EQ(b.insert_batch(batch), 1);
+  EXPECT_EQ(b.at_left(2), 5);
+  EXPECT_EQ(b.find_left(1), b.end_left());
+}
+
+template <typename Policy>
+void check_range_erase() {
+  using map_t = bimap<int, int, std::less<int>, std::less<int>,
+                      std::allocator<std::pair<int, int>>, Policy>;
+  map_t b;
+  for (int i = 0; i < 1000; i++) {
+    b.insert(i, (i * 7) % 1000);
+  }
+  EXPECT_EQ(b.erase_left(b.find_left(100), b.find_left(300)),
+            b.find_left(300));
+  EXPECT_EQ(b.erase_right(b.lower_bound_right(900), b.end_right()),
+            b.end_right());
+  EXPECT_EQ(b.erase_left(b.begin_left(), b.find_left(10)), b.find_left(10));
+  std::vector<int> lefts;
+  for (int i = 10; i < 1000; i++) {
+    if ((i < 100 || i >= 300) && (i * 7) % 1000 < 900) {
+      lefts.push_back(i);
+    }
+  }
+  ASSERT_EQ(b.size(), lefts.size());
+  EXPECT_EQ(std::vector<int>(b.begin_left(), b.end_left()), lefts);
+  for (int x : lefts) {
+    EXPECT_EQ(*b.find_right((x * 7) % 1000).flip(), x);
+  }
+  b.erase_right(b.begin_right(), b.end_right());
+  EXPECT_TRUE(b.empty());
+  EXPECT_EQ(b.begin_left(), b.end_left());
+}
+
+TEST(bimap, range_erase) {
+  check_range_erase<default_bimap_policy>();
+  check_range_erase<compact_bimap_policy>();
+  check_range_erase<order_statistics_bimap_policy>();
+}
+
+TEST(bimap, build_parallel) {
+  std::vector<std::pair<int, int>> data;
+  std::mt19937 e(9);
+  for (int i = 0; i < 40000; i++) {
+    data.emplace_back(e() % 32000, e() % 32000);
+  }
+  auto expected = bimap<int, int>::from_sorted(data);
+  for (unsigned threads : {1u, 2u, 3u, 8u}) {
+    auto b = bimap<int, int>::build_parallel(data, threads);
+    EXPECT_EQ(b, expected);
+    EXPECT_EQ(std::vector<int>(b.begin_right(), b.end_right()),
+              std::vector<int>(expected.begin_right(), expected.end_right()));
+  }
+  using ranked = bimap<int, int, std::less<int>, std::less<int>,
+                       std::allocator<std::pair<int, int>>,
+                       order_statistics_bimap_policy>;
+  auto r = ranked::build_parallel(data, 4);
+  EXPECT_EQ(r.size(), expected.size());
+  EXPECT_EQ(*r.nth_left(r.size() / 2),
+            *std::next(expected.begin_left(), r.size() / 2));
+  EXPECT_EQ(r.end_right() - r.begin_right(), r.size());
+}
+
+template <typename Policy>
+void check_merge(unsigned threads) {
+  using map_t = bimap<int, int, std::less<int>, std::less<int>,
+                      std::allocator<std::pair<int, int>>, Policy>;
+  map_t a, b;
+  std::mt19937 e(threads);
+  for (int i = 0; i < 20000; i++) {
+    a.insert(e() % 50000, e() % 50000);
+    b.insert(e() % 50000, e() % 50000);
+  }
+  std::vector<std::pair<int, int>> moved, kept;
+  std::set<int> lefts(a.begin_left(), a.end_left());
+  std::set<int> rights(a.begin_right(), a.end_right());
+  for (auto it = b.begin_left(); it != b.end_left(); it++) {
+    if (lefts.count(*it) || rights.count(*it.flip())) {
+      kept.emplace_back(*it, *it.flip());
+    } else {
+      moved.emplace_back(*it, *it.flip());
+    }
+  }
+  int const* stolen = &*b.find_left(moved.front().first);
+  size_t before = a.size();
+
+  a.merge(std::move(b), threads);
+  EXPECT_EQ(a.size(), before + moved.size());
+  EXPECT_EQ(b.size(), kept.size());
+  EXPECT_EQ(&*a.find_left(moved.front().first), stolen);
+  for (auto const& p : moved) {
+    EXPECT_EQ(a.at_left(p.first), p.second);
+  }
+  map_t expected = map_t::from_sorted(kept);
+  EXPECT_EQ(b, expected);
+  EXPECT_EQ(std::vector<int>(b.begin_right(), b.end_right()),
+            std::vector<int>(expected.begin_right(), expected.end_right()));
+  std::vector<int> a_rights(a.begin_right(), a.end_right());
+  EXPECT_TRUE(std::is_sorted(a_rights.begin(), a_rights.end()));
+  EXPECT_EQ(a_rights.size(), a.size());
+  for (int r : a_rights) {
+    EXPECT_EQ(*a.find_left(*a.find_right(r).flip()).flip(), r);
+  }
+  if constexpr (map_t::order_statistics) {
+    EXPECT_EQ(a.end_left() - a.begin_left(), a.size());
+    EXPECT_EQ(a.end_right() - a.begin_right(), a.size());
+    EXPECT_EQ(b.end_right() - b.begin_right(), b.size());
+  }
+}
+
+TEST(bimap, merge) {
+  check_merge<default_bimap_policy>(1);
+  check_merge<default_bimap_policy>(4);
+  check_merge<compact_bimap_policy>(2);
+  check_merge<order_statistics_bimap_policy>(3);
+
+  using alloc = pool_allocator<std::pair<int, int>>;
+  bimap<int, int, std::less<int>, std::less<int>, alloc> a, b;
+  a.insert(1, 1);
+  b.insert(1, 2);
+  b.insert(2, 3);
+  b.insert(3, 1);
+  a.merge(std::move(b));
+  EXPECT_EQ(a.size(), 2);
+  EXPECT_EQ(a.at_left(2), 3);
+  EXPECT_EQ(b.size(), 2);
+  EXPECT_EQ(b.at_left(3), 1);
+}
+
+template <typename Policy>
+void check_split_left() {
+  using map_t = bimap<int, int, std::less<int>, std::less<int>,
+                      std::allocator<std::pair<int, int>>, Policy>;
+  map_t a;
+  std::map<int, int> expected;
+  std::mt19937 e(13);
+  for (int i = 0; i < 3000; i++) {
+    int left = e() % 10000;
+    int right = e() % 10000;
+    if (a.insert(left, right) != a.end_left()) {
+      expected.emplace(left, right);
+    }
+  }
+  int const* moved_key = &*a.lower_bound_left(7000);
+  map_t b = a.split_left(5000);
+  EXPECT_EQ(&*b.lower_bound_left(7000), moved_key);
+  std::map<int, int> expected_b(expected.lower_bound(5000), expected.end());
+  expected.erase(expected.lower_bound(5000), expected.end());
+  for (auto [m, em] : {std::pair<map_t*, std::map<int, int>*>(&a, &expected),
+                       {&b, &expected_b}}) {
+    ASSERT_EQ(m->size(), em->size());
+    auto it = m->begin_left();
+    for (auto const& p : *em) {
+      EXPECT_EQ(*it, p.first);
+      EXPECT_EQ(*it.flip(), p.second);
+      EXPECT_EQ(m->find_right(p.second).flip(), it);
+      it++;
+    }
+    std::vector<int> rights(m->begin_right(), m->end_right());
+    EXPECT_TRUE(std::is_sorted(rights.begin(), rights.end()));
+    EXPECT_EQ(rights.size(), m->size());
+    if constexpr (map_t::order_statistics) {
+      EXPECT_EQ(m->end_right() - m->begin_right(), m->size());
+      EXPECT_EQ(m->end_left() - m->begin_left(), m->size());
+    }
+  }
+  EXPECT_TRUE(a.split_left(20000).empty());
+  map_t all = a.split_left(-1);
+  EXPECT_TRUE(a.empty());
+  EXPECT_EQ(all.size(), expected.size());
+}
+
+TEST(bimap, split_left) {
+  check_split_left<default_bimap_policy>();
+  check_split_left<compact_bimap_policy>();
+  check_split_left<order_statistics_bimap_policy>();
+}
+
+template <typename Policy>
+void check_analyze() {
+  using map_t = bimap<int, int, std::less<int>, std::less<int>,
+                      std::allocator<std::pair<int, int>>, Policy>;
+  map_t b;
+  EXPECT_TRUE(b.analyze().valid());
+  EXPECT_TRUE(b.analyze().left.depths.empty());
+  std::mt19937 e(5);
+  for (int i = 0; i < 3000; i++) {
+    b.insert(static_cast<int>(e() % 5000), static_cast<int>(e() % 5000));
+  }
+  for (int i = 0; i < 1000; i++) {
+    b.erase_left(static_cast<int>(e() % 5000));
+  }
+  bimap_shape shape = b.analyze();
+  EXPECT_TRUE(shape.valid());
+  for (details::tree_shape const *side : {&shape.left, &shape.right}) {
+    EXPECT_EQ(side->nodes, b.size());
+    EXPECT_EQ(side->depths[0], 1);
+    EXPECT_EQ(std::accumulate(side->depths.begin(), side->depths.end(),
+                              size_t(0)),
+              b.size());
+    EXPECT_GT(side->leaf_depths.back(), 0);
+    EXPECT_LT(side->depths.size(), 60);
+  }
+}
+
+TEST(bimap, analyze) {
+  check_analyze<default_bimap_policy>();
+  check_analyze<compact_bimap_policy>();
+  check_analyze<order_statistics_bimap_policy>();
+}
+
+TEST(bimap, snapshot) {
+  using map_t = bimap<int, double>;
+  std::vector<std::pair<int, double>> pairs;
+  std::mt19937 e(9);
+  for (int i = 0; i < 5000; i++) {
+    pairs.emplace_back(static_cast<int>(e()), e() / 7.0);
+  }
+  map_t b = map_t::from_sorted(pairs);
+  std::stringstream stream;
+  b.save(stream);
+  std::string bytes = stream.str();
+  EXPECT_EQ(map_t::load(stream), b);
+
+  std::string path = testing::TempDir() + "bimap_snapshot.bin";
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  ASSERT_GE(fd, 0);
+  b.save(fd);
+  ::close(fd);
+  map_t loaded = map_t::load(path);
+  EXPECT_EQ(loaded, b);
+  EXPECT_TRUE(loaded.analyze().valid());
+  loaded.insert(1, 1.5);
+  EXPECT_EQ(loaded.size(), b.size() + 1);
+
+  std::stringstream empty;
+  map_t().save(empty);
+  EXPECT_TRUE(map_t::load(empty).empty());
+
+  auto load_bytes = [](std::string const &data) {
+    std::stringstream in(data);
+    return map_t::load(in);
+  };
+  std::string damaged = bytes;
+  damaged[damaged.size() / 2] ^= 1;
+  EXPECT_THROW(load_bytes(damaged), snapshot_error);
+  EXPECT_THROW(load_bytes(bytes.substr(0, bytes.size() - 1)), snapshot_error);
+  EXPECT_THROW(load_bytes(bytes.substr(0, 10)), snapshot_error);
+  std::stringstream in(bytes);
+  EXPECT_THROW((bimap<int, float>::load(in)), snapshot_error);
+  std::stringstream reversed(bytes);
+  EXPECT_THROW((bimap<int, double, std::greater<int>>::load(reversed)),
+               snapshot_error);
+  EXPECT_THROW(map_t::load(path + ".missing"), std::system_error);
+  std::remove(path.c_str());
+}
+
+TEST(frozen_bimap, lookups) {
+  using map_t = bimap<int, double>;
+  std::vector<std::pair<int, double>> pairs;
+  std::mt19937 e(11);
+  for (int i = 0; i < 3001; i++) {
+    pairs.emplace_back(static_cast<int>(e() % 100000) * 2, e() / 7.0);
+  }
+  std::sort(pairs.begin(), pairs.end());
+  pairs.erase(std::unique(pairs.begin(), pairs.end(),
+                          [](auto const &a, auto const &b) {
+                            return a.first == b.first;
+                          }),
+              pairs.end());
+  map_t b = map_t::from_sorted(pairs);
+  std::string path = testing::TempDir() + "frozen_bimap.bin";
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  ASSERT_GE(fd, 0);
+  b.save(fd);
+  ::close(fd);
+
+  frozen_bimap<int, double> f(path);
+  f.verify();
+  ASSERT_EQ(f.size(), b.size());
+  EXPECT_TRUE(std::equal(f.begin_left(), f.end_left(), b.begin_left()));
+  EXPECT_TRUE(std::equal(f.begin_right(), f.end_right(), b.begin_right()));
+  for (auto it = b.begin_left(); it != b.end_left(); ++it) {
+    ASSERT_EQ(f.at_left(*it), *it.flip());
+    ASSERT_EQ(f.at_right(*it.flip()), *it);
+    ASSERT_EQ(*f.find_left(*it).flip().flip(), *it);
+    EXPECT_EQ(f.find_left(*it + 1), f.end_left());
+    EXPECT_EQ(*f.lower_bound_left(*it - 1), *it);
+    EXPECT_EQ(f.upper_bound_right(*it.flip()),
+              std::next(f.find_right(*it.flip())));
+  }
+  EXPECT_EQ(f.end_left().flip(), f.end_right());
+  EXPECT_EQ(f.upper_bound_left(pairs.back().first), f.end_left());
+  EXPECT_EQ(*f.nth_right(5), *std::next(b.begin_right(), 5));
+  EXPECT_EQ(f.rank_left(pairs[7].first), 7u);
+  EXPECT_THROW(f.at_left(1), std::out_of_range);
+
+  frozen_bimap<int, double> copy = f;
+  auto it = copy.begin_right();
+  f = frozen_bimap<int, double>(path);
+  EXPECT_EQ(*it, *b.begin_right());
+
+  std::string bytes;
+  {
+    std::stringstream out;
+    b.save(out);
+    bytes = out.str();
+  }
+  bytes[bytes.size() / 3] ^= 1;
+  fd = ::open(path.c_str(), O_WRONLY | O_TRUNC);
+  ASSERT_GE(fd, 0);
+  details::write_all(fd, bytes.data(), bytes.size());
+  ::close(fd);
+  frozen_bimap<int, double> damaged(path);
+  EXPECT_THROW(damaged.verify(), snapshot_error);
+  EXPECT_THROW((frozen_bimap<int, float>(path)), snapshot_error);
+  EXPECT_THROW((frozen_bimap<int, double, std::greater<int>>(path).verify()),
+               snapshot_error);
+
+  bytes[bytes.size() / 3] ^= 1;
+  details::snapshot_layout layout(sizeof(int), sizeof(double), b.size());
+  std::fill_n(&bytes[layout.left_partners], sizeof(uint64_t), '\xff');
+  fd = ::open(path.c_str(), O_WRONLY | O_TRUNC);
+  ASSERT_GE(fd, 0);
+  details::write_all(fd, bytes.data(), bytes.size());
+  ::close(fd);
+  frozen_bimap<int, double> unpaired(path);
+  EXPECT_EQ(unpaired.begin_left().flip(), unpaired.end_right());
+  EXPECT_THROW(unpaired.at_left(pairs[0].first), snapshot_error);
+  EXPECT_EQ(unpaired.at_left(pairs[1].first), pairs[1].second);
+  EXPECT_THROW(unpaired.verify(), snapshot_error);
+  std::remove(path.c_str());
+}
+
+TEST(bimap, statistics) {
+  using map_t = bimap<int, int, std::less<int>, std::less<int>,
+                      std::allocator<std::pair<int, int>>,
+                      instrumented_bimap_policy>;
+  map_t b;
+  for (int i = 0; i < 1000; i++) {
+    b.insert(i * 7 % 1000, i);
+  }
+  b.insert(5, 5000);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_NE(b.find_left(i), b.end_left());
+  }
+  b.lower_bound_right(10);
+  b.erase_left(3);
+
+  bimap_stats stats = b.stats();
+  EXPECT_EQ(stats.allocations, 1000);
+  EXPECT_EQ(stats.frees, 1);
+  EXPECT_GE(stats.left.finds, 100);
+  EXPECT_GE(stats.left.find_comparisons, stats.left.finds);
+  EXPECT_EQ(stats.right.searches, 1);
+  EXPECT_GE(stats.left.splits, 1000);
+  EXPECT_GE(stats.left.merges, 1);
+  EXPECT_GE(stats.right.max_depth, 10);
+  EXPECT_LE(stats.right.max_depth, 60);
+  EXPECT_GE(stats.left.average_depth, 5);
+  EXPECT_LE(stats.left.average_depth, stats.left.max_depth);
+  EXPECT_EQ(map_t().stats().left.max_depth, 0);
+
+  // without the policy the counters take no space, a tree is its sentinel
+  // and the cached tail
+  EXPECT_EQ(sizeof(details::tree<int, std::less<int>, left_tag,
+                                 default_bimap_policy>),
+            sizeof(details::node_base_t<default_bimap_policy>) +
+                sizeof(void*));
+}
+
+TEST(bimap, concurrent_construction) {
+  std::vector<bimap<int, int>> maps(4);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < maps.size(); t++) {
+    threads.emplace_back([&maps, t] {
+      bimap<int, int>::seed_priorities(t + 1);
+      for (int i = 0; i < 10000; i++) {
+        maps[t].insert(i, -i);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (auto const &b : maps) {
+    EXPECT_EQ(b, maps[0]);
+  }
+
+  // unseeded threads draw different priorities
+  std::vector<std::vector<uint32_t>> drawn(2);
+  threads.clear();
+  for (auto &priorities : drawn) {
+    threads.emplace_back([&priorities] {
+      for (int i = 0; i < 16; i++) {
+        priorities.push_back(details::get_next_random_uint32_t());
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_NE(drawn[0], drawn[1]);
+}
+
+TEST(concurrent_bimap, single_thread) {
+  concurrent_bimap<int, std::string> b;
+  std::map<int, std::string> expected;
+  std::mt19937 e(1);
+  for (int i = 0; i < 2000; i++) {
+    int key = static_cast<int>(e() % 500);
+    if (e() % 3 == 0) {
+      auto it = expected.find(key);
+      EXPECT_EQ(b.erase_left(key), it != expected.end());
+      if (it != expected.end()) {
+        expected.erase(it);
+      }
+    } else {
+      bool fresh = expected.count(key) == 0;
+      EXPECT_EQ(b.insert(key, std::to_string(key)), fresh);
+      expected.emplace(key, std::to_string(key));
+    }
+  }
+  EXPECT_EQ(b.size(), expected.size());
+  for (int key = 0; key < 500; key++) {
+    auto it = expected.find(key);
+    EXPECT_EQ(b.find_left(key).has_value(), it != expected.end());
+    EXPECT_EQ(b.find_right(std::to_string(key)).has_value(),
+              it != expected.end());
+  }
+  EXPECT_FALSE(b.insert(1000, expected.begin()->second));
+  EXPECT_TRUE(b.erase_right(expected.begin()->second));
+  EXPECT_THROW(b.at_left(expected.begin()->first), std::out_of_range);
+  EXPECT_EQ(b.at_right(std::next(expected.begin())->second),
+            std::next(expected.begin())->first);
+}
+
+TEST(concurrent_bimap, readers_during_writes) {
+  concurrent_bimap<int, int> b;
+  for (int i = 0; i < 100; i += 2) {
+    b.insert(i, -i);
+  }
+  std::atomic<bool> done{false};
+  std::atomic<size_t> mismatches{0};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 3; t++) {
+    readers.emplace_back([&b, &done, &mismatches] {
+      while (!done.load()) {
+        for (int i = 0; i < 100; i++) {
+          std::optional<int> right = b.find_left(i);
+          if (right && *right != -i) {
+            mismatches++;
+          }
+          std::optional<int> left = b.find_right(-i);
+          if (left && *left != i) {
+            mismatches++;
+          }
+        }
+      }
+    });
+  }
+  for (int round = 0; round < 200; round++) {
+    for (int i = 0; i < 100; i++) {
+      if (!b.erase_left(i)) {
+        b.insert(i, -i);
+      }
+    }
+  }
+  done = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(mismatches.load(), 0);
+  EXPECT_EQ(b.size(), 50);
+  EXPECT_EQ(b.at_left(0), 0);
+}
+
+TEST(persistent_bimap, snapshots) {
+  using map_t = persistent_bimap<int, int>;
+  map_t b;
+  std::map<int, int> expected;
+  std::vector<std::pair<map_t, std::map<int, int>>> versions;
+  std::mt19937 e(2);
+  for (int i = 0; i < 3000; i++) {
+    int key = static_cast<int>(e() % 700);
+    if (e() % 3 == 0) {
+      EXPECT_EQ(b.erase_right(-key), expected.erase(key) == 1);
+    } else {
+      bool fresh = expected.emplace(key, -key).second;
+      EXPECT_EQ(b.insert(key, -key), fresh);
+    }
+    if (i % 100 == 0) {
+      versions.emplace_back(b.snapshot(), expected);
+    }
+  }
+  versions.emplace_back(std::move(b), expected);
+  EXPECT_TRUE(b.empty());
+  for (auto const &[version, contents] : versions) {
+    ASSERT_EQ(version.size(), contents.size());
+    auto it = contents.begin();
+    for (auto left = version.begin_left(); left != version.end_left();
+         left++, it++) {
+      EXPECT_EQ(*left, it->first);
+      EXPECT_EQ(*left.flip(), it->second);
+    }
+    auto rit = contents.rbegin();
+    for (auto right = version.begin_right(); right != version.end_right();
+         ++right, ++rit) {
+      EXPECT_EQ(*right, rit->second);
+    }
+  }
+  map_t const &last = versions.back().first;
+  EXPECT_EQ(last.find_left(1000), last.end_left());
+  EXPECT_EQ(last.find_left(1000).flip(), last.end_right());
+  EXPECT_THROW(last.at_right(1), std::out_of_range);
+  int key = versions.back().second.begin()->first;
+  EXPECT_EQ(last.at_left(key), -key);
+  EXPECT_EQ(*last.find_right(-key).flip(), key);
+}
+
+TEST(sharded_bimap, concurrent_inserts) {
+  sharded_bimap<int, int> b(4);
+  std::vector<std::thread> writers;
+  for (int t = 0; t < 4; t++) {
+    writers.emplace_back([&b, t] {
+      // every left key and every right key is offered by two threads
+      for (int i = 0; i < 2000; i++) {
+        b.insert(i, (i + t / 2 * 7) % 2000);
+      }
+    });
+  }
+  for (auto &writer : writers) {
+    writer.join();
+  }
+  bimap<int, int> all = b.collect();
+  EXPECT_EQ(all.size(), b.size());
+  std::set<int> lefts, rights;
+  for (auto it = all.begin_left(); it != all.end_left(); it++) {
+    EXPECT_TRUE(lefts.insert(*it).second);
+    EXPECT_TRUE(rights.insert(*it.flip()).second);
+    EXPECT_EQ(b.at_left(*it), *it.flip());
+    EXPECT_EQ(b.at_right(*it.flip()), *it);
+  }
+}
+
+TEST(sharded_bimap, pool_allocator) {
+  using map_t =
+      sharded_bimap<int, int, std::less<int>, std::less<int>, std::hash<int>,
+                    std::hash<int>, pool_allocator<std::pair<int, int>>>;
+  map_t b(4);
+  std::vector<std::thread> writers;
+  for (int t = 0; t < 4; t++) {
+    writers.emplace_back([&b, t] {
+      for (int i = t; i < 4000; i += 4) {
+        EXPECT_TRUE(b.insert(i, -i));
+      }
+      for (int i = t; i < 4000; i += 8) {
+        EXPECT_TRUE(b.erase_left(i));
+      }
+    });
+  }
+  for (auto &writer : writers) {
+    writer.join();
+  }
+  EXPECT_EQ(b.size(), 2000);
+  EXPECT_EQ(b.at_right(-5), 5);
+  EXPECT_FALSE(b.find_left(8).has_value());
+}
+
+TEST(sharded_bimap, erase) {
+  sharded_bimap<int, std::string> b(3);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_TRUE(b.insert(i, std::to_string(i)));
+  }
+  EXPECT_FALSE(b.insert(200, "5"));
+  EXPECT_FALSE(b.insert(5, "200"));
+  EXPECT_TRUE(b.erase_left(5));
+  EXPECT_FALSE(b.erase_left(5));
+  EXPECT_TRUE(b.erase_right("6"));
+  EXPECT_FALSE(b.erase_right("6"));
+  EXPECT_FALSE(b.find_left(6).has_value());
+  EXPECT_FALSE(b.find_right("5").has_value());
+  EXPECT_TRUE(b.insert(200, "5"));
+  EXPECT_EQ(b.at_right("5"), 200);
+  EXPECT_THROW(b.at_left(5), std::out_of_range);
+  EXPECT_EQ(b.size(), 99);
+}
+
 template <typename T>
 std::vector<std::pair<T, T>>
 eliminate_same(std::vector<T> &lefts, std::vector<T> &rights, std::mt19937 &e) {